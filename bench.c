@@ -0,0 +1,246 @@
+// Benchmark harness for abysh, build it with `./build.sh bench`
+// Every result is printed as a single line of JSON on stdout so runs can be compared
+#include <stdlib.h>
+
+// Every heap allocation the shell makes goes through these, to show that warmed up
+// loops stay off the heap
+size_t heap_allocs=0;
+
+void* counted_malloc(size_t size) {
+	heap_allocs++;
+	return malloc(size);
+}
+
+void* counted_realloc(void* ptr,size_t size) {
+	heap_allocs++;
+	return realloc(ptr,size);
+}
+
+#define main abysh_main
+#define malloc(size) counted_malloc(size)
+#define realloc(ptr,size) counted_realloc(ptr,size)
+#include "main.c"
+#undef realloc
+#undef malloc
+#undef main
+
+#define BENCH_HISTORY_LINES 100000
+#define BENCH_PIPE_BYTES "64M"
+#define BENCH_PIPE_CAPACITY "1M"
+#define BENCH_HIGHLIGHT_BYTES (16*1024)
+
+void report(char* bench,char* metric,double value,char* unit) {
+	printf("{\"bench\":\"%s\",\"metric\":\"%s\",\"value\":%.3f,\"unit\":\"%s\"}\n",bench,metric,value,unit);
+	fflush(stdout);
+}
+
+// Generated corpus mixing the constructs compile_text has to deal with
+char* corpus_line(size_t i,char* buf,size_t size) {
+	switch(i%4) {
+		case 0:
+			snprintf(buf,size,"echo hello %zu world \"quoted %zu string\" $HOME ~/file.txt",i,i);
+			break;
+		case 1:
+			snprintf(buf,size,"FOO=bar%zu BAZ=$FOO grep -in --color pattern%zu main.c | head -5 | wc -l",i,i);
+			break;
+		case 2:
+			snprintf(buf,size,"ls -la /usr/bin/ \\| escaped\\ space $? # trailing comment %zu",i);
+			break;
+		default:
+			snprintf(buf,size,"VAR%zu=value%zu",i,i);
+	}
+	return buf;
+}
+
+void bench_parse(size_t lines) {
+	Program prog={0};
+	char buf[256];
+	size_t bytes=0;
+	double start=clock_seconds();
+	size_t allocs=0;
+	for(size_t i=0; i<lines; i++) {
+		// the first lines warm up the arrays the program is compiled into
+		if(i==lines/2) allocs=heap_allocs;
+		size_t len=strlen(corpus_line(i,buf,sizeof(buf)));
+		bytes+=len;
+		program_reset(&prog);
+		compile_text(&prog,buf,len,0,NULL,NULL);
+	}
+	double elapsed=clock_seconds()-start;
+	report("compile_text","lines_per_sec",lines/elapsed,"lines/s");
+	report("compile_text","bytes_per_sec",bytes/elapsed,"B/s");
+	report("compile_text","warm_heap_allocs",heap_allocs-allocs,"allocs");
+	program_free(&prog);
+}
+
+// Compiles and runs a line of builtins the way the REPL does, once warmed up neither
+// the loop nor the assignments should touch the heap
+void bench_script(size_t runs) {
+	static StrArr history={0};
+	static char cwd[PATH_MAX];
+	char line[]="for i in 1 2 3 4 5 6 7 8; do x=$i; done; x=a; x=b; x=c";
+	Program prog={0};
+	Runner r={.history=&history,.cwd=&cwd};
+	getcwd(cwd,PATH_MAX);
+	size_t allocs=0;
+	double start=clock_seconds();
+	for(size_t i=0; i<runs; i++) {
+		if(i==runs/2) allocs=heap_allocs;
+		program_reset(&prog);
+		if(compile_text(&prog,line,strlen(line),0,NULL,NULL)) run_program(&prog,false,&r);
+	}
+	report("run_program","line_us",(clock_seconds()-start)/runs*1e6,"us");
+	report("run_program","warm_heap_allocs",heap_allocs-allocs,"allocs");
+	program_free(&prog);
+}
+
+void bench_expand_path(size_t lookups) {
+	char* names[]={"ls","grep","cat","sh","wc","head"};
+	size_t count=sizeof(names)/sizeof(names[0]);
+	char resolved[PATH_MAX];
+	char* pathenv=getenv("PATH");
+	double start=clock_seconds();
+	for(size_t i=0; i<lookups; i++) {
+		path_hash_clear();
+		expand_path((StrArr) {.items=&names[i%count],.len=1},"",pathenv,resolved);
+	}
+	report("expand_path","uncached_ns",(clock_seconds()-start)/lookups*1e9,"ns");
+	start=clock_seconds();
+	for(size_t i=0; i<lookups; i++) {
+		expand_path((StrArr) {.items=&names[i%count],.len=1},"",pathenv,resolved);
+	}
+	report("expand_path","cached_ns",(clock_seconds()-start)/lookups*1e9,"ns");
+}
+
+// Runs line through the real compile/run path with the shell's stdout sent to /dev/null
+double run_line(char* line) {
+	static StrArr history={0};
+	static char cwd[PATH_MAX];
+	static Program prog={0};
+	static Runner r={.history=&history,.cwd=&cwd};
+	getcwd(cwd,PATH_MAX);
+	fflush(stdout);
+	int saved=dup(STDOUT_FILENO);
+	int devnull=open("/dev/null",O_WRONLY);
+	dup2(devnull,STDOUT_FILENO);
+	close(devnull);
+	double start=clock_seconds();
+	program_reset(&prog);
+	if(compile_text(&prog,line,strlen(line),0,NULL,NULL)) run_program(&prog,false,&r);
+	double elapsed=clock_seconds()-start;
+	dup2(saved,STDOUT_FILENO);
+	close(saved);
+	return elapsed;
+}
+
+void bench_spawn(size_t runs,size_t stages) {
+	char line[1024];
+	size_t len=0;
+	for(size_t i=0; i<stages && len<sizeof(line)-16; i++) {
+		len+=snprintf(line+len,sizeof(line)-len,"%s/bin/true",i?" | ":"");
+	}
+	double total=0;
+	for(size_t i=0; i<runs; i++) total+=run_line("/bin/true");
+	report("spawn","single_stage_us",total/runs*1e6,"us");
+	total=0;
+	for(size_t i=0; i<runs; i++) total+=run_line(line);
+	report("spawn","per_stage_us",total/runs/stages*1e6,"us");
+	// the same launch again with a bigger heap, spawn cost should not grow with it
+	size_t ballast=256*1024*1024;
+	char* heap=malloc(ballast);
+	memset(heap,1,ballast);
+	total=0;
+	for(size_t i=0; i<runs; i++) total+=run_line("/bin/true");
+	report("spawn","single_stage_256M_heap_us",total/runs*1e6,"us");
+	free(heap);
+}
+
+void bench_pipeline(size_t stages) {
+	char line[1024];
+	size_t len=snprintf(line,sizeof(line),"head -c %s /dev/zero",BENCH_PIPE_BYTES);
+	for(size_t i=0; i<stages && len<sizeof(line)-16; i++) {
+		len+=snprintf(line+len,sizeof(line)-len," | cat");
+	}
+	double elapsed=run_line(line);
+	report("pipeline","throughput",64.0*1024*1024/elapsed,"B/s");
+	// again with bigger pipes, so every stage wakes up less often per byte
+	set_var("ABYSH_PIPESIZE",14,BENCH_PIPE_CAPACITY,false);
+	elapsed=run_line(line);
+	unset_var("ABYSH_PIPESIZE",14);
+	report("pipeline","throughput_" BENCH_PIPE_CAPACITY "_pipes",64.0*1024*1024/elapsed,"B/s");
+	report("pipeline","stages",stages,"stages");
+}
+
+// Typing into the middle and onto the end of a long line, highlighting it after every key
+void bench_highlight(size_t keys) {
+	StrBuf line={0};
+	char buf[256];
+	for(size_t i=0; line.len<BENCH_HIGHLIGHT_BYTES; i++) {
+		for(char* ch=corpus_line(i,buf,sizeof(buf)); *ch; ch++) da_append(&line,*ch);
+		da_append(&line,';');
+	}
+	highlight(str_text(line.items,line.len));
+	size_t at[]={line.len/2,SIZE_MAX};
+	char* metrics[]={"keystroke_mid_us","keystroke_end_us"};
+	for(size_t m=0; m<2; m++) {
+		double start=clock_seconds();
+		for(size_t i=0; i<keys; i++) {
+			size_t pos=at[m]<line.len?at[m]:line.len;
+			da_append(&line,'\0');
+			memmove(line.items+pos+1,line.items+pos,line.len-pos-1);
+			line.items[pos]="echo x|"[i%7];
+			highlight(str_text(line.items,line.len));
+		}
+		report("highlight",metrics[m],(clock_seconds()-start)/keys*1e6,"us");
+	}
+	report("highlight","line_bytes",line.len,"B");
+	free(line.items);
+}
+
+void bench_startup(size_t lines) {
+	char home[]="/tmp/abysh-bench-XXXXXX";
+	if(mkdtemp(home)==NULL) return;
+	char histname[PATH_MAX];
+	snprintf(histname,sizeof(histname),"%s/.abysh_history",home);
+	FILE* histfile=fopen(histname,"w");
+	char buf[256];
+	for(size_t i=0; i<lines; i++) fprintf(histfile,"%s\n",corpus_line(i,buf,sizeof(buf)));
+	fclose(histfile);
+	StrArr history={0};
+	double start=clock_seconds();
+	populate_history(&history,home);
+	report("startup","history_load_ms",(clock_seconds()-start)*1e3,"ms");
+	report("startup","history_entries",history.len,"entries");
+	// suggestions while typing out history lines, one lookup per keystroke
+	size_t lookups=0;
+	start=clock_seconds();
+	for(size_t i=0; i<lines; i+=lines/100) {
+		corpus_line(i,buf,sizeof(buf));
+		for(size_t len=1; buf[len]; len++, lookups++) hist_prefix_find(history.items,buf,len);
+	}
+	report("startup","suggestion_ns",(clock_seconds()-start)/lookups*1e9,"ns");
+	close(histfd);
+	histfd=-1;
+	unlink(histname);
+	rmdir(home);
+}
+
+int main(int argc,char** argv) {
+	pname="abysh-bench";
+	size_t lines=argc>1?strtoull(argv[1],NULL,10):200000;
+	size_t stages=argc>2?strtoull(argv[2],NULL,10):8;
+	if(lines==0 || stages==0) {
+		fprintf(stderr,"usage: %s [parse lines] [pipeline stages]\n",argv[0]);
+		return 1;
+	}
+	if(getenv("PATH")==NULL) setenv("PATH","/usr/local/sbin:/usr/local/bin:/usr/bin",1);
+	signal(SIGTTOU,SIG_IGN);
+	bench_parse(lines);
+	bench_script(lines/10);
+	bench_expand_path(lines/10);
+	bench_spawn(200,stages);
+	bench_pipeline(stages);
+	bench_highlight(2000);
+	bench_startup(BENCH_HISTORY_LINES);
+	return 0;
+}
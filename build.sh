@@ -1,5 +1,13 @@
 #!/bin/bash
 
 set -xe
+if [ "$1" = "bench" ]; then
+	gcc -ftabstop=1 -Wall -Wextra -O2 -o abysh-bench bench.c
+	./abysh-bench "${@:2}"
+	exit
+fi
 gcc -ftabstop=1 -Wall -Wextra -ggdb -o abysh main.c
-
+if [ "$1" = "test" ]; then
+	gcc -ftabstop=1 -Wall -Wextra -o abysh-test test.c -lutil
+	./abysh-test
+fi
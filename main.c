@@ -1,22 +1,56 @@
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <pwd.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
-#define MAX_CMD_LEN 4096
 #define VERSION "0.5.0"
 
+#ifndef USE_POSIX_SPAWN
+#define USE_POSIX_SPAWN 1
+#endif
+
+// Linux only, fcntl.h leaves it out unless _GNU_SOURCE is defined
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#endif
+
+// glibc 2.35 and later, spawn.h leaves it out unless _GNU_SOURCE is defined
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2,35)
+#define SPAWN_TCSETPGRP 1
+int posix_spawn_file_actions_addtcsetpgrp_np(posix_spawn_file_actions_t* actions,int fd);
+#endif
+
 #define HIST_BUF_CAP (1024*1024)
+#define PATH_HASH_INIT_CAP 64
+#define VAR_TABLE_INIT_CAP 64
+#define VAR_ENTRY_MIN_CAP 32
+#define HIST_INDEX_INIT_CAP 4096
+#define SEARCH_MAX_RESULTS 64
+#define INPUT_READ_BLOCK (64*1024)
+#define COMPLETION_MAX_SHOWN 200
+#define SUBST_MAX_DEPTH 64
+#define GIT_PROMPT_TTL 5
 
 typedef struct {
 	char** items;
@@ -30,36 +64,283 @@ typedef struct {
 	size_t len;
 } StrBuf;
 
+typedef struct {
+	size_t* items;
+	size_t cap;
+	size_t len;
+} Offsets;
+
+typedef enum {
+	REDIR_READ,
+	REDIR_WRITE,
+	REDIR_APPEND,
+	REDIR_DUP,
+} RedirKind;
+
+// A redirection of fd once its file name is expanded, src is the descriptor that
+// gets duplicated onto fd (the opened file or the one named by >&)
+typedef struct {
+	RedirKind kind;
+	int fd;
+	int src;
+	int saved;
+	bool applied;
+	char* path;
+} Redirect;
+
+typedef struct {
+	Redirect* items;
+	size_t cap;
+	size_t len;
+} Redirects;
+
 typedef struct {
 	StrArr current;
 	StrArr tmpvars;
+	Redirects redirects;
 	pid_t pid;
+	int status;
+	double wall;
+	struct rusage usage;
 } Cmd;
 
 typedef struct {
 	Cmd* items;
 	size_t cap;
 	size_t len;
-	size_t longest;
+	bool timed;
+	bool background;
 } Cmds;
 
+typedef enum {
+	PART_LIT,
+	PART_VAR,
+	PART_STATUS,
+	PART_HOME,
+	PART_SUBST,
+} PartKind;
+
+// A piece of a word, literals and variable names live in Program.text while a command
+// substitution has the index of its compiled commands in Program.subs as off
+typedef struct {
+	PartKind kind;
+	size_t off;
+	size_t len;
+} Part;
+
+typedef struct {
+	Part* items;
+	size_t cap;
+	size_t len;
+} Parts;
+
+typedef struct {
+	size_t part;
+	size_t len;
+	bool quoted;
+} Word;
+
+typedef struct {
+	Word* items;
+	size_t cap;
+	size_t len;
+} Words;
+
+// A redirection as written, both marks &> which also sends stderr to the file
+typedef struct {
+	RedirKind kind;
+	int fd;
+	int dupfd;
+	bool both;
+	Word target;
+} Redir;
+
+typedef struct {
+	Redir* items;
+	size_t cap;
+	size_t len;
+} Redirs;
+
+// A pipeline stage, the first nvars words are NAME=value assignments
+typedef struct {
+	size_t word;
+	size_t len;
+	size_t nvars;
+	size_t redir;
+	size_t nredirs;
+} Stage;
+
+typedef struct {
+	Stage* items;
+	size_t cap;
+	size_t len;
+} Stages;
+
+typedef struct {
+	size_t stage;
+	size_t len;
+	size_t line;
+	bool timed;
+	bool background;
+} Pipeline;
+
+typedef struct {
+	Pipeline* items;
+	size_t cap;
+	size_t len;
+} Pipelines;
+
+typedef enum {
+	NODE_PIPELINE,
+	NODE_AND,
+	NODE_OR,
+	NODE_IF,
+	NODE_WHILE,
+	NODE_FOR,
+} NodeKind;
+
+#define NO_NODE SIZE_MAX
+
+// A command of the syntax tree, the commands of a list are chained through next.
+// left and right are the two sides of && and ||, or the condition and body of if and
+// while, orelse holds the else branch of an if (an elif is another if there).
+// A for loop has its variable name in word followed by len words to iterate over
+typedef struct {
+	NodeKind kind;
+	size_t pipeline;
+	size_t left;
+	size_t right;
+	size_t orelse;
+	size_t word;
+	size_t len;
+	size_t next;
+} Node;
+
+typedef struct {
+	Node* items;
+	size_t cap;
+	size_t len;
+} Nodes;
+
+typedef struct {
+	struct Program** items;
+	size_t cap;
+	size_t len;
+} Programs;
+
+// Tokenized commands, only variable expansion is left to do before running them,
+// top holds the nodes of the top level commands in order
+typedef struct Program {
+	StrBuf text;
+	Parts parts;
+	Words words;
+	Redirs redirs;
+	Stages stages;
+	Pipelines pipelines;
+	Nodes nodes;
+	Offsets top;
+	Programs subs;
+} Program;
+
 #define DA_INIT_CAP 4
-#define da_append(arr,item)                                         \
-    do {                                                            \
-        if((arr)->len>=(arr)->cap) {                                \
-            if((arr)->cap) (arr)->cap*=2;                           \
-            else (arr)->cap=DA_INIT_CAP;                            \
-            void* items=malloc((arr)->cap*sizeof(item));            \
-            if((arr)->items) {                                      \
-                memcpy(items,(arr)->items,(arr)->len*sizeof(item)); \
-                free((arr)->items);                                 \
-            }                                                       \
-            (arr)->items=items;                                     \
-        }                                                           \
-        (arr)->items[(arr)->len++]=item;                            \
+#define da_append(arr,item)                                                 \
+    do {                                                                    \
+        if((arr)->len>=(arr)->cap) {                                        \
+            if((arr)->cap) (arr)->cap*=2;                                   \
+            else (arr)->cap=DA_INIT_CAP;                                    \
+            (arr)->items=realloc((arr)->items,(arr)->cap*sizeof(*(arr)->items)); \
+        }                                                                   \
+        (arr)->items[(arr)->len++]=item;                                    \
+    } while(0)
+
+// Same as da_append, but the array lives in an arena and is dropped with it
+#define arena_da_append(arena,arr,item)                                     \
+    do {                                                                    \
+        if((arr)->len>=(arr)->cap) {                                        \
+            size_t oldcap=(arr)->cap;                                       \
+            if((arr)->cap) (arr)->cap*=2;                                   \
+            else (arr)->cap=DA_INIT_CAP;                                    \
+            (arr)->items=arena_grow((arena),(arr)->items,oldcap*sizeof(*(arr)->items),(arr)->cap*sizeof(*(arr)->items)); \
+        }                                                                   \
+        (arr)->items[(arr)->len++]=item;                                    \
     } while(0)
 
+#define ARENA_CHUNK_CAP (64*1024)
+#define ARENA_ALIGN 16
+
+typedef struct ArenaChunk {
+	struct ArenaChunk* next;
+	size_t cap;
+	size_t len;
+	char data[];
+} ArenaChunk;
+
+// Bump allocator for everything that only lives while one command line runs,
+// chunks are kept across resets so a warmed up arena never touches the heap
+typedef struct {
+	ArenaChunk* first;
+	ArenaChunk* current;
+	void* last;
+} Arena;
+
+void* arena_alloc(Arena* arena,size_t size) {
+	size=(size+ARENA_ALIGN-1)&~(size_t)(ARENA_ALIGN-1);
+	ArenaChunk* chunk=arena->current;
+	while(chunk==NULL || chunk->len+size>chunk->cap) {
+		if(chunk && chunk->next && chunk->next->cap>=size) {
+			chunk=chunk->next;
+			chunk->len=0;
+			continue;
+		}
+		size_t cap=size>ARENA_CHUNK_CAP?size:ARENA_CHUNK_CAP;
+		ArenaChunk* fresh=malloc(sizeof(ArenaChunk)+cap);
+		fresh->cap=cap;
+		fresh->len=0;
+		fresh->next=chunk?chunk->next:NULL;
+		if(chunk) chunk->next=fresh;
+		else arena->first=fresh;
+		chunk=fresh;
+	}
+	arena->current=chunk;
+	void* ptr=chunk->data+chunk->len;
+	chunk->len+=size;
+	arena->last=ptr;
+	return ptr;
+}
+
+// Extends the most recent allocation in place when possible
+void* arena_grow(Arena* arena,void* ptr,size_t oldsize,size_t newsize) {
+	ArenaChunk* chunk=arena->current;
+	if(ptr && ptr==arena->last && (char*)ptr+newsize<=chunk->data+chunk->cap) {
+		chunk->len=(char*)ptr-chunk->data+((newsize+ARENA_ALIGN-1)&~(size_t)(ARENA_ALIGN-1));
+		return ptr;
+	}
+	void* items=arena_alloc(arena,newsize);
+	if(ptr) memcpy(items,ptr,oldsize);
+	return items;
+}
+
+void arena_reset(Arena* arena) {
+	arena->current=arena->first;
+	arena->last=NULL;
+	if(arena->first) arena->first->len=0;
+}
+
+// Everything running a program needs besides the program itself
+typedef struct {
+	Cmds cmds;
+	Arena arena;
+	// the words of the for loops being run, innermost last, outliving the arena
+	// resets their bodies do
+	StrBuf loops;
+	StrArr* history;
+	char(*cwd)[PATH_MAX];
+	int status;
+	bool interrupted;
+} Runner;
+
 typedef struct termios Termios;
+extern char** environ;
 Termios initial_state={0};
 int keys_fd=0;
 size_t term_width=80;
@@ -70,7 +351,7 @@ size_t histidx=0;
 static char pathbuf[PATH_MAX];
 
 size_t trim(char** str) {
-	size_t len=strnlen(*str,MAX_CMD_LEN);
+	size_t len=strlen(*str);
 	while(len && isspace((*str)[len-1])) {
 		len--;
 	}
@@ -78,405 +359,2565 @@ size_t trim(char** str) {
 		(*str)++;
 		len--;
 	}
-	if(len<MAX_CMD_LEN) (*str)[len]='\0';
+	(*str)[len]='\0';
 	return len;
 }
 
-bool parse_string(char* command,size_t len,size_t* idx,StrBuf* parsedcmd) {
+void program_free(Program* prog);
+
+void program_reset(Program* prog) {
+	for(size_t i=0; i<prog->subs.len; i++) {
+		program_free(prog->subs.items[i]);
+		free(prog->subs.items[i]);
+	}
+	prog->subs.len=0;
+	prog->text.len=0;
+	prog->parts.len=0;
+	prog->words.len=0;
+	prog->redirs.len=0;
+	prog->stages.len=0;
+	prog->pipelines.len=0;
+	prog->nodes.len=0;
+	prog->top.len=0;
+}
+
+void program_free(Program* prog) {
+	program_reset(prog);
+	free(prog->text.items);
+	free(prog->parts.items);
+	free(prog->words.items);
+	free(prog->redirs.items);
+	free(prog->stages.items);
+	free(prog->pipelines.items);
+	free(prog->nodes.items);
+	free(prog->top.items);
+	free(prog->subs.items);
+}
+
+// Drops everything compiled into prog since saved was taken
+void program_truncate(Program* prog,Program* saved) {
+	for(size_t i=saved->subs.len; i<prog->subs.len; i++) {
+		program_free(prog->subs.items[i]);
+		free(prog->subs.items[i]);
+	}
+	prog->subs.len=saved->subs.len;
+	prog->text.len=saved->text.len;
+	prog->parts.len=saved->parts.len;
+	prog->words.len=saved->words.len;
+	prog->redirs.len=saved->redirs.len;
+	prog->stages.len=saved->stages.len;
+	prog->pipelines.len=saved->pipelines.len;
+	prog->nodes.len=saved->nodes.len;
+	prog->top.len=saved->top.len;
+}
+
+void syntax_error(size_t lineno,char* msg) {
+	if(lineno) fprintf(stderr,"%s: line %zu: %s\n",pname,lineno,msg);
+	else fprintf(stderr,"%s: %s\n",pname,msg);
+}
+
+// Where compiling is at in text, line is only brought up to date with i when a line
+// number is needed so counting newlines costs nothing until then (0 means unnumbered).
+// When more is set the text can still grow, running out of it inside a command then
+// sets incomplete instead of being an error
+typedef struct {
+	Program* prog;
+	char* text;
+	size_t len;
+	size_t i;
+	size_t line;
+	size_t counted;
+	bool more;
+	bool incomplete;
+} Parser;
+
+size_t parser_line(Parser* p) {
+	if(p->line==0) return 0;
+	for(; p->counted<p->i && p->counted<p->len; p->counted++) {
+		if(p->text[p->counted]=='\n') p->line++;
+	}
+	return p->line;
+}
+
+void parse_error(Parser* p,char* msg) {
+	syntax_error(parser_line(p),msg);
+}
+
+// The text ended where something else was expected
+void parse_eof(Parser* p,char* msg) {
+	if(p->more) p->incomplete=true;
+	else parse_error(p,msg);
+}
+
+void add_part(Program* prog,PartKind kind,char* str,size_t len) {
+	Part* lastpart=prog->parts.len?&prog->parts.items[prog->parts.len-1]:NULL;
+	Word* word=&prog->words.items[prog->words.len-1];
+	bool merge=kind==PART_LIT && word->len && lastpart->kind==PART_LIT && lastpart->off+lastpart->len==prog->text.len;
+	for(size_t i=0; i<len; i++) da_append(&prog->text,str[i]);
+	if(merge) {
+		lastpart->len+=len;
+		return;
+	}
+	da_append(&prog->parts,((Part) {.kind=kind,.off=prog->text.len-len,.len=len}));
+	word->len++;
+}
+
+bool is_name_char(char ch) {
+	return isalnum(ch) || ch=='_';
+}
+
+bool ends_word(char* line,size_t len,size_t i) {
+	return i>=len || isspace(line[i]) || line[i]=='|' || line[i]=='&' || line[i]==';' || line[i]=='<' || line[i]=='>';
+}
+
+bool parse_string(Program* prog,char* line,size_t len,size_t* idx) {
 	if(*idx>=len) return false;
-	if(command[*idx]!='"') return false;
+	if(line[*idx]!='"') return false;
 	for((*idx)++; *idx<len; (*idx)++) {
-		if(command[*idx]=='"') {
+		if(line[*idx]=='"') {
+			(*idx)++;
 			return true;
 		}
-		if(command[*idx]=='\\') {
+		if(line[*idx]=='\\') {
 			if(*idx+1<len) {
-				if(command[*idx+1]=='"' || command[*idx+1]=='\\') {
-					da_append(parsedcmd,command[++*idx]);
+				if(line[*idx+1]=='"' || line[*idx+1]=='\\') {
+					add_part(prog,PART_LIT,line+ ++*idx,1);
 					continue;
 				}
-				da_append(parsedcmd,'\\');
+				add_part(prog,PART_LIT,"\\",1);
 				continue;
 			}
 			return false;
 		}
-		da_append(parsedcmd,command[*idx]);
+		add_part(prog,PART_LIT,line+*idx,1);
 	}
 	return false;
 }
 
-bool parse_args(Cmds* cmds,char* command,StrBuf* parsedcmd) {
-	size_t len=trim(&command);
-	size_t tlen=0;
-	parsedcmd->len=0;
-	char* varstart=NULL;
-	size_t argstart=0;
-	struct {
-		int* items;
-		size_t cap;
-		size_t len;
-	} indexes={0};
-	bool parsingenv=true;
-	bool result=true;
-	for(size_t i=0; i<len; i++) {
-		if(command[i]=='=') {
-			if(!parsingenv) {
-				tlen++;
-				goto addchr;
-			}
-			if(tlen) {
-				varstart=command+i-tlen;
-				goto addchr;
-			}
+bool compile_text(Program* prog,char* text,size_t len,size_t lineno,bool* incomplete,size_t* done);
+
+// Finds where the text of a $( or backtick substitution starting at line[start] ends,
+// skipping quoted and escaped characters and nested parentheses
+bool subst_end(char* line,size_t len,size_t start,char close,size_t* end) {
+	size_t depth=1;
+	for(size_t i=start; i<len; i++) {
+		if(line[i]=='\\') {
+			i++;
+		} else if(line[i]==close && (close=='`' || --depth==0)) {
+			*end=i;
+			return true;
+		} else if(line[i]=='(' && close==')') {
+			depth++;
+		} else if(line[i]=='"') {
+			for(i++; i<len && line[i]!='"'; i++) i+=line[i]=='\\';
 		}
-		if(command[i]=='\\') {
+	}
+	return false;
+}
+
+// Compiles the commands of a substitution into a program of their own, so the word
+// around them keeps its parts together
+bool compile_subst(Parser* p,size_t start,size_t end) {
+	Program* sub=calloc(1,sizeof(Program));
+	if(!compile_text(sub,p->text+start,end-start,parser_line(p),NULL,NULL)) {
+		program_free(sub);
+		free(sub);
+		return false;
+	}
+	da_append(&p->prog->subs,sub);
+	add_part(p->prog,PART_SUBST,"",0);
+	p->prog->parts.items[p->prog->parts.len-1].off=p->prog->subs.len-1;
+	return true;
+}
+
+// Lexes the word at the parser's position into a new entry of prog->words, NAME=value
+// assignments are only recognized when assign is not NULL and then reported through it
+bool compile_word(Parser* p,bool* assign) {
+	Program* prog=p->prog;
+	char* line=p->text;
+	size_t len=p->len;
+	da_append(&prog->words,((Word) {.part=prog->parts.len}));
+	Word* word=&prog->words.items[prog->words.len-1];
+	size_t start=p->i;
+	size_t i=p->i;
+	while(!ends_word(line,len,i)) {
+		char ch=line[i];
+		if(ch=='\\') {
 			if(i+1>=len) {
-				tlen++;
-				goto addchr;
+				add_part(prog,PART_LIT,line+i++,1);
+				continue;
 			}
-			da_append(parsedcmd,command[++i]);
-			tlen++;
+			add_part(prog,PART_LIT,line+i+1,1);
+			i+=2;
 			continue;
 		}
-		if(command[i]=='#' && tlen==0) break;
-		if(command[i]=='|') {
-			if(tlen==0 && parsingenv) {
-				fprintf(stderr,"%s: unexpected '|'\n",pname);
-				result=false;
-				break;
+		if(ch=='"') {
+			if(!parse_string(prog,line,len,&i)) {
+				parse_eof(p,"unexpected EOF while looking for matching '\"'");
+				return false;
 			}
-			if(tlen) {
-				da_append(parsedcmd,'\0');
-				da_append(&indexes,(int)argstart);
-				argstart=parsedcmd->len;
-				tlen=0;
+			word->quoted=true;
+			continue;
+		}
+		if(ch=='=' && assign && !*assign && i>start && !isdigit(line[start])) {
+			*assign=true;
+			for(size_t j=start; j<i && *assign; j++) *assign=is_name_char(line[j]);
+			add_part(prog,PART_LIT,line+i++,1);
+			if(*assign && i<len && line[i]=='~' && (ends_word(line,len,i+1) || line[i+1]=='/')) {
+				add_part(prog,PART_HOME,"",0);
+				i++;
 			}
-			da_append(&indexes,-2);
-			parsingenv=true;
 			continue;
 		}
-		if(command[i]=='"') {
-			size_t lastidx=i;
-			if(!parse_string(command,len,&lastidx,parsedcmd)) {
-				fprintf(stderr,"%s: unexpected EOF while looking for matching '\"'\n",pname);
+		if(ch=='~' && i==start && (ends_word(line,len,i+1) || line[i+1]=='/')) {
+			add_part(prog,PART_HOME,"",0);
+			i++;
+			continue;
+		}
+		if((ch=='$' && i+1<len && line[i+1]=='(') || ch=='`') {
+			size_t start=ch=='`'?i+1:i+2;
+			size_t end;
+			if(!subst_end(line,len,start,ch=='`'?'`':')',&end)) {
+				parse_eof(p,ch=='`'?"unexpected EOF while looking for matching '`'":"unexpected EOF while looking for matching ')'");
 				return false;
 			}
-			tlen+=lastidx-i-1;
-			i=lastidx;
+			if(!compile_subst(p,start,end)) return false;
+			i=end+1;
 			continue;
 		}
-		if(command[i]=='~') {
-			if((tlen>0 && varstart==NULL) || (varstart && varstart-command-tlen==1)) {
-				tlen++;
-				goto addchr;
-			}
-			if(i+1>=len || isspace(command[i+1]) || command[i+1]=='|' || command[i+1]=='/') {
-				char* homedir=getenv("HOME");
-				if(homedir!=NULL) {
-					size_t homelen=strlen(homedir);
-					for(size_t i=0; i<homelen; i++) {
-						da_append(parsedcmd,homedir[i]);
-					}
-					tlen+=homelen;
-					continue;
-				}
-				goto addchr;
-			}
+		if(ch=='$' && i+1<len && line[i+1]=='?') {
+			add_part(prog,PART_STATUS,"",0);
+			i+=2;
+			continue;
 		}
-		if(command[i]=='$') {
+		if(ch=='$' && i+1<len && is_name_char(line[i+1])) {
 			size_t varend=i+1;
-			if(varend<len && command[varend]=='?') {
-				for(size_t j=0; retbuf[j]!='\0'; j++) {
-					da_append(parsedcmd,retbuf[j]);
-				}
-				i++;
-				continue;
-			}
-			while(varend<len && isalnum(command[varend])) varend++;
-			if(varend==i+1) {
-				tlen++;
-				goto addchr;
-			}
-			bool incmd=(varstart==NULL);
-			bool found=false;
-			size_t parsedlen=parsedcmd->len;
-			for(size_t j=indexes.len; j>0 && indexes.items[j-1]!=-2; j--) {
-				if(indexes.items[j-1]==-1) {
-					incmd=false;
-					continue;
+			while(varend<len && is_name_char(line[varend])) varend++;
+			add_part(prog,PART_VAR,line+i+1,varend-i-1);
+			i=varend;
+			continue;
+		}
+		add_part(prog,PART_LIT,line+i++,1);
+	}
+	p->i=i;
+	return true;
+}
+
+// Recognizes a redirection operator at line[i], optionally preceded by a file descriptor
+// number, returns its length (0 when there is none) and fills redir except for its target
+size_t redir_op(char* line,size_t len,size_t i,Redir* redir) {
+	if(line[i]=='&' && i+1<len && line[i+1]=='>') {
+		bool append=i+2<len && line[i+2]=='>';
+		*redir=(Redir) {.kind=append?REDIR_APPEND:REDIR_WRITE,.fd=STDOUT_FILENO,.both=true};
+		return append?3:2;
+	}
+	size_t j=i;
+	int fd=-1;
+	while(j<len && isdigit(line[j]) && j-i<4) fd=(fd<0?0:fd*10)+line[j++]-'0';
+	if(j>=len || (line[j]!='<' && line[j]!='>')) return 0;
+	if(line[j]=='<') {
+		*redir=(Redir) {.kind=REDIR_READ,.fd=fd<0?STDIN_FILENO:fd};
+		return j+1-i;
+	}
+	*redir=(Redir) {.kind=REDIR_WRITE,.fd=fd<0?STDOUT_FILENO:fd};
+	if(j+1<len && line[j+1]=='>') {
+		redir->kind=REDIR_APPEND;
+		return j+2-i;
+	}
+	if(j+1<len && line[j+1]=='&') {
+		redir->kind=REDIR_DUP;
+		return j+2-i;
+	}
+	return j+1-i;
+}
+
+// Skips blanks and a comment, stopping at the end of the line
+void skip_blanks(Parser* p) {
+	while(p->i<p->len && p->text[p->i]!='\n' && isspace(p->text[p->i])) p->i++;
+	if(p->i<p->len && p->text[p->i]=='#') {
+		while(p->i<p->len && p->text[p->i]!='\n') p->i++;
+	}
+}
+
+void skip_lines(Parser* p) {
+	skip_blanks(p);
+	while(p->i<p->len && p->text[p->i]=='\n') {
+		p->i++;
+		skip_blanks(p);
+	}
+}
+
+bool at_op(Parser* p,char* op) {
+	size_t oplen=strlen(op);
+	return p->len-p->i>=oplen && strncmp(p->text+p->i,op,oplen)==0;
+}
+
+// Reserved words are only recognized unquoted where a command starts
+bool at_keyword(Parser* p,char* kw) {
+	return at_op(p,kw) && ends_word(p->text,p->len,p->i+strlen(kw));
+}
+
+// Whatever follows a pipeline (a list or and-or operator) is left to the caller
+bool at_pipeline_end(Parser* p) {
+	return p->i>=p->len || p->text[p->i]=='\n' || p->text[p->i]==';' || at_op(p,"&&") || at_op(p,"||");
+}
+
+size_t add_node(Program* prog,NodeKind kind) {
+	da_append(&prog->nodes,((Node) {.kind=kind,.left=NO_NODE,.right=NO_NODE,.orelse=NO_NODE,.next=NO_NODE}));
+	return prog->nodes.len-1;
+}
+
+// Tokenizes the pipeline at the parser's position into prog without touching the environment
+bool compile_pipeline(Parser* p) {
+	Program* prog=p->prog;
+	char* line=p->text;
+	size_t len=p->len;
+	Pipeline pipeline={.stage=prog->stages.len,.line=parser_line(p)};
+	Stage stage={.word=prog->words.len,.redir=prog->redirs.len};
+	while(1) {
+		skip_blanks(p);
+		if(at_pipeline_end(p)) break;
+		Redir redir;
+		size_t oplen=redir_op(line,len,p->i,&redir);
+		if(oplen) {
+			for(p->i+=oplen; p->i<len && line[p->i]!='\n' && isspace(line[p->i]); p->i++);
+			if(redir.kind==REDIR_DUP) {
+				if(p->i>=len || !isdigit(line[p->i])) {
+					parse_error(p,"expected a file descriptor after '>&'");
+					return false;
 				}
-				if(incmd) continue;
-				char* eq=strchr(parsedcmd->items+indexes.items[j-1],'=');
-				if(eq==NULL) continue;
-				if(eq-parsedcmd->items!=(int)(varend-i-1)) continue;
-				if(strncmp(parsedcmd->items+indexes.items[j-1],command+i+1,varend-i-1)!=0) continue;
-				for(size_t k=indexes.items[j-1]+varend-i; k<parsedlen && parsedcmd->items[k]!='\0'; k++) {
-					da_append(parsedcmd,parsedcmd->items[k]);
-					tlen++;
+				for(redir.dupfd=0; p->i<len && isdigit(line[p->i]) && redir.dupfd<10000; p->i++) redir.dupfd=redir.dupfd*10+line[p->i]-'0';
+			} else {
+				if(ends_word(line,len,p->i) || line[p->i]=='<' || line[p->i]=='>') {
+					parse_error(p,"expected a file name after redirection");
+					return false;
 				}
-				found=true;
-				break;
+				if(!compile_word(p,NULL)) return false;
+				redir.target=prog->words.items[--prog->words.len];
 			}
-			if(found) {
-				i=varend-1;
-				continue;
+			bool both=redir.both;
+			redir.both=false;
+			da_append(&prog->redirs,redir);
+			stage.nredirs++;
+			if(both) {
+				da_append(&prog->redirs,((Redir) {.kind=REDIR_DUP,.fd=STDERR_FILENO,.dupfd=STDOUT_FILENO}));
+				stage.nredirs++;
 			}
-			for(size_t j=i+1; j<varend; j++) {
-				da_append(parsedcmd,command[j]);
+			continue;
+		}
+		if(line[p->i]=='|') {
+			if(stage.len==0 && stage.nredirs==0) {
+				parse_error(p,"unexpected '|'");
+				return false;
 			}
-			da_append(parsedcmd,'\0');
-			char* var=getenv(parsedcmd->items+parsedlen);
-			parsedcmd->len=parsedlen;
-			if(var==NULL) continue;
-			size_t varlen=strlen(var);
-			for(size_t j=0; j<varlen; j++) {
-				da_append(parsedcmd,var[j]);
-				tlen++;
+			da_append(&prog->stages,stage);
+			pipeline.len++;
+			stage=(Stage) {.word=prog->words.len,.redir=prog->redirs.len};
+			// the next command can be on the following line
+			p->i++;
+			skip_lines(p);
+			if(p->i>=len) {
+				parse_eof(p,"expected a command after '|'");
+				return false;
 			}
-			i=varend-1;
 			continue;
 		}
-		if(isspace(command[i])) {
-			if(tlen==0) continue;
-			if(varstart) {
-				varstart=NULL;
-			} else {
-				if(parsingenv) da_append(&indexes,-1);
-				parsingenv=false;
+		if(line[p->i]=='&') {
+			if(stage.len==0 && stage.nredirs==0) {
+				parse_error(p,"unexpected '&'");
+				return false;
 			}
-			da_append(&indexes,argstart);
-			da_append(parsedcmd,'\0');
-			argstart=parsedcmd->len;
-			tlen=0;
+			pipeline.background=true;
+			p->i++;
+			break;
+		}
+		size_t start=p->i;
+		bool assign=false;
+		if(!compile_word(p,stage.len==stage.nvars?&assign:NULL)) return false;
+		// a leading `time` is a keyword that reports the resource usage of the whole pipeline
+		if(pipeline.len==0 && stage.len==0 && !pipeline.timed && p->i-start==4 && strncmp(line+start,"time",4)==0) {
+			prog->words.len--;
+			prog->parts.len=prog->words.items[prog->words.len].part;
+			pipeline.timed=true;
 			continue;
-		} else {
-			tlen++;
 		}
-addchr:
-		da_append(parsedcmd,command[i]);
+		if(assign) stage.nvars++;
+		stage.len++;
 	}
-	// FIXME this logic is kinda messed up, BUT IT WORKS
-	while(tlen) {
-		tlen=0;
-		da_append(parsedcmd,'\0');
-		if(parsingenv && varstart) da_append(&indexes,(int)(varstart-command));
-		if(parsingenv) da_append(&indexes,-1);
-		if(varstart) break;
-		da_append(&indexes,(int)argstart);
-	}
-	parsingenv=true;
-	if(cmds->longest==0) {
-		da_append(cmds,(Cmd) {0});
-		cmds->longest=1;
-	}
-	cmds->len=1;
-	Cmd* cmd=&cmds->items[0];
-	cmd->current.len=0;
-	cmd->tmpvars.len=0;
-	for(size_t curcmd=0,i=0; i<indexes.len; i++) {
-		if(indexes.items[i]==-1) {
-			parsingenv=false;
-			continue;
+	if(stage.len==0 && stage.nredirs==0) {
+		if(pipeline.len>0) {
+			parse_error(p,"expected a command after '|'");
+			return false;
 		}
-		if(indexes.items[i]==-2) {
-			curcmd++;
-			while(curcmd>=cmds->longest) {
-				da_append(cmds,(Cmd) {0});
-				cmds->longest++;
-			}
-			cmd=&cmds->items[curcmd];
-			cmd->current.len=0;
-			cmd->tmpvars.len=0;
-			parsingenv=true;
-			continue;
+		if(!pipeline.timed) {
+			char msg[32];
+			snprintf(msg,sizeof(msg),"unexpected '%.*s'",at_op(p,"&&") || at_op(p,"||")?2:1,line+p->i);
+			parse_error(p,msg);
+			return false;
 		}
-		if(parsingenv) da_append(&cmd->tmpvars,parsedcmd->items+indexes.items[i]);
-		else da_append(&cmd->current,parsedcmd->items+indexes.items[i]);
 	}
-	return result;
+	if(stage.len || stage.nredirs) {
+		da_append(&prog->stages,stage);
+		pipeline.len++;
+	}
+	da_append(&prog->pipelines,pipeline);
+	return true;
 }
 
-void expand_path(StrArr cmd,char* cwd,char* pathenv,char* pathbuf) {
-	if(pathenv==NULL) return;
-	if(cmd.len) {
-		size_t len=strlen(cmd.items[0]);
-		size_t tlen=0;
-		for(size_t i=0; i<len; i++) {
-			if(cmd.items[0][i]=='/') {
-				if(i==0) { // Absolute path
-					snprintf(pathbuf,PATH_MAX,"%s",cmd.items[0]);
-					pathbuf[PATH_MAX-1]='\0';
-					return;
-				}
-				snprintf(pathbuf,PATH_MAX,"%s/%s",cwd,cmd.items[0]);
-				pathbuf[PATH_MAX-1]='\0';
-				return;
-			}
-		}
-		len=strlen(pathenv);
-		for(size_t i=0; i<=len; i++) {
-			if(pathenv[i]==':' || i==len) {
-				snprintf(pathbuf,PATH_MAX,"%.*s/%s",(int)tlen,pathenv+i-tlen,cmd.items[0]);
-				pathbuf[PATH_MAX-1]='\0';
-				if(access(pathbuf,X_OK)==0) return;
-				tlen=0;
-				continue;
-			}
-			tlen++;
-		}
-		pathbuf[0]='\0';
+bool compile_list(Parser* p,char** stops,size_t* first);
+
+// A compound command has to be the whole command, so only a separator may follow it
+bool end_compound(Parser* p,char* kw) {
+	p->i+=strlen(kw);
+	skip_blanks(p);
+	if(at_pipeline_end(p)) return true;
+	char msg[64];
+	snprintf(msg,sizeof(msg),"expected ';' or a newline after '%s'",kw);
+	parse_error(p,msg);
+	return false;
+}
+
+// Compiles a list that must not be empty, it ends at one of stops which is left in place
+bool compile_body(Parser* p,char* after,char** stops,size_t* first) {
+	p->i+=strlen(after);
+	size_t start=p->i;
+	if(!compile_list(p,stops,first)) return false;
+	if(*first!=NO_NODE) return true;
+	char msg[64];
+	snprintf(msg,sizeof(msg),"expected a command after '%s'",after);
+	p->i=start;
+	parse_error(p,msg);
+	return false;
+}
+
+// kw is the `if` or `elif` the parser is at, an elif compiles into a nested if that
+// also takes care of the closing fi
+bool compile_if(Parser* p,char* kw,size_t* node) {
+	static char* then[]={"then",NULL};
+	static char* branch[]={"elif","else","fi",NULL};
+	static char* fi[]={"fi",NULL};
+	size_t cond;
+	size_t body;
+	if(!compile_body(p,kw,then,&cond)) return false;
+	if(!compile_body(p,"then",branch,&body)) return false;
+	*node=add_node(p->prog,NODE_IF);
+	p->prog->nodes.items[*node].left=cond;
+	p->prog->nodes.items[*node].right=body;
+	size_t orelse=NO_NODE;
+	if(at_keyword(p,"elif")) {
+		if(!compile_if(p,"elif",&orelse)) return false;
+		p->prog->nodes.items[*node].orelse=orelse;
+		return true;
+	}
+	if(at_keyword(p,"else")) {
+		if(!compile_body(p,"else",fi,&orelse)) return false;
+		p->prog->nodes.items[*node].orelse=orelse;
 	}
+	return end_compound(p,"fi");
 }
 
-void remove_dir(char* res,char* path) {
-	char* shortpath=path;
-	for(size_t i=0; path && path[i]; i++) {
-		if(path[i]=='/') {
-			shortpath=path+i+1;
+bool compile_while(Parser* p,size_t* node) {
+	static char* loop_do[]={"do",NULL};
+	static char* done[]={"done",NULL};
+	size_t cond;
+	size_t body;
+	if(!compile_body(p,"while",loop_do,&cond)) return false;
+	if(!compile_body(p,"do",done,&body)) return false;
+	*node=add_node(p->prog,NODE_WHILE);
+	p->prog->nodes.items[*node].left=cond;
+	p->prog->nodes.items[*node].right=body;
+	return end_compound(p,"done");
+}
+
+// for NAME in word...; do list; done
+bool compile_for(Parser* p,size_t* node) {
+	static char* done[]={"done",NULL};
+	Program* prog=p->prog;
+	p->i+=3;
+	skip_blanks(p);
+	size_t start=p->i;
+	while(p->i<p->len && is_name_char(p->text[p->i])) p->i++;
+	if(p->i==start || isdigit(p->text[start]) || !ends_word(p->text,p->len,p->i)) {
+		p->i=start;
+		if(p->i>=p->len) parse_eof(p,"expected a variable name after 'for'");
+		else parse_error(p,"expected a variable name after 'for'");
+		return false;
+	}
+	size_t word=prog->words.len;
+	da_append(&prog->words,((Word) {.part=prog->parts.len}));
+	add_part(prog,PART_LIT,p->text+start,p->i-start);
+	skip_lines(p);
+	if(!at_keyword(p,"in")) {
+		if(p->i>=p->len) parse_eof(p,"expected 'in' after the variable of 'for'");
+		else parse_error(p,"expected 'in' after the variable of 'for'");
+		return false;
+	}
+	p->i+=2;
+	size_t len=0;
+	while(1) {
+		skip_blanks(p);
+		if(p->i>=p->len) {
+			parse_eof(p,"expected 'do'");
+			return false;
+		}
+		if(p->text[p->i]==';' || p->text[p->i]=='\n') {
+			p->i++;
+			break;
+		}
+		if(ends_word(p->text,p->len,p->i) || p->text[p->i]=='<' || p->text[p->i]=='>') {
+			char msg[32];
+			snprintf(msg,sizeof(msg),"unexpected '%c'",p->text[p->i]);
+			parse_error(p,msg);
+			return false;
 		}
+		if(!compile_word(p,NULL)) return false;
+		len++;
 	}
-	strcpy(res,shortpath);
+	skip_lines(p);
+	if(!at_keyword(p,"do")) {
+		if(p->i>=p->len) parse_eof(p,"expected 'do'");
+		else parse_error(p,"expected 'do'");
+		return false;
+	}
+	size_t body;
+	if(!compile_body(p,"do",done,&body)) return false;
+	*node=add_node(prog,NODE_FOR);
+	prog->nodes.items[*node].word=word;
+	prog->nodes.items[*node].len=len;
+	prog->nodes.items[*node].right=body;
+	return end_compound(p,"done");
 }
 
-void getsize(int _sig) {
-	(void)_sig;
-	struct winsize win;
-	ioctl(0,TIOCGWINSZ,&win);
-	term_width=win.ws_col;
+bool compile_command(Parser* p,size_t* node) {
+	if(at_keyword(p,"if")) return compile_if(p,"if",node);
+	if(at_keyword(p,"while")) return compile_while(p,node);
+	if(at_keyword(p,"for")) return compile_for(p,node);
+	size_t pipeline=p->prog->pipelines.len;
+	if(!compile_pipeline(p)) return false;
+	*node=add_node(p->prog,NODE_PIPELINE);
+	p->prog->nodes.items[*node].pipeline=pipeline;
+	return true;
 }
 
-void readline(char* prompt,StrBuf* command,StrArr history) {
-	static StrBuf killring={0};
+// Commands joined by && and ||, which bind equally tight from left to right
+bool compile_and_or(Parser* p,size_t* node) {
+	if(!compile_command(p,node)) return false;
+	while(1) {
+		skip_blanks(p);
+		bool and=at_op(p,"&&");
+		if(!and && !at_op(p,"||")) return true;
+		p->i+=2;
+		skip_lines(p);
+		if(p->i>=p->len) {
+			parse_eof(p,and?"expected a command after '&&'":"expected a command after '||'");
+			return false;
+		}
+		size_t right;
+		if(!compile_command(p,&right)) return false;
+		size_t left=*node;
+		*node=add_node(p->prog,and?NODE_AND:NODE_OR);
+		p->prog->nodes.items[*node].left=left;
+		p->prog->nodes.items[*node].right=right;
+	}
+}
+
+// Compiles the next command of a list separated by newlines, ';' or '&', node is NO_NODE
+// once the list ends at one of the reserved words in stops (or the text when it is NULL)
+bool compile_next(Parser* p,char** stops,size_t* node) {
+	static char* closing[]={"then","elif","else","fi","do","done",NULL};
+	*node=NO_NODE;
+	skip_lines(p);
+	if(p->i>=p->len) {
+		if(stops==NULL) return true;
+		char** closer=stops;
+		while(closer[1]) closer++;
+		char msg[64];
+		snprintf(msg,sizeof(msg),"unexpected EOF while looking for '%s'",*closer);
+		parse_eof(p,msg);
+		return false;
+	}
+	for(char** stop=stops; stop && *stop; stop++) {
+		if(at_keyword(p,*stop)) return true;
+	}
+	for(char** kw=closing; *kw; kw++) {
+		if(!at_keyword(p,*kw)) continue;
+		char msg[32];
+		snprintf(msg,sizeof(msg),"unexpected '%s'",*kw);
+		parse_error(p,msg);
+		return false;
+	}
+	if(p->text[p->i]==';') {
+		parse_error(p,"unexpected ';'");
+		return false;
+	}
+	if(!compile_and_or(p,node)) return false;
+	skip_blanks(p);
+	if(p->i<p->len && (p->text[p->i]==';' || p->text[p->i]=='\n')) p->i++;
+	return true;
+}
+
+bool compile_list(Parser* p,char** stops,size_t* first) {
+	*first=NO_NODE;
+	size_t last=NO_NODE;
+	while(1) {
+		size_t node;
+		if(!compile_next(p,stops,&node)) return false;
+		if(node==NO_NODE) return true;
+		if(last==NO_NODE) *first=node;
+		else p->prog->nodes.items[last].next=node;
+		last=node;
+	}
+}
+
+// Compiles text into prog->top, reporting syntax errors with line numbers counted from
+// lineno (if any). On failure the commands before the bad one stay compiled, and done
+// (when given) tells how much of text is dealt with: up to the unfinished command, or
+// through the line with the syntax error. When incomplete is given more text may follow,
+// running out of it in the middle of a command then sets it instead of being an error
+bool compile_text(Program* prog,char* text,size_t len,size_t lineno,bool* incomplete,size_t* done) {
+	Parser p={.prog=prog,.text=text,.len=len,.line=lineno,.more=incomplete!=NULL};
+	if(incomplete) *incomplete=false;
+	while(1) {
+		Program saved=*prog;
+		size_t start=p.i;
+		size_t node;
+		if(!compile_next(&p,NULL,&node)) {
+			program_truncate(prog,&saved);
+			if(incomplete) *incomplete=p.incomplete;
+			if(done && p.incomplete) {
+				*done=start;
+			} else if(done) {
+				char* endl=p.i<len?memchr(text+p.i,'\n',len-p.i):NULL;
+				*done=endl?(size_t)(endl-text)+1:len;
+			}
+			return false;
+		}
+		if(node==NO_NODE) break;
+		da_append(&prog->top,node);
+	}
+	if(done) *done=len;
+	return true;
+}
+
+uint64_t hash_str(const char* str,size_t len) {
+	uint64_t hash=14695981039346656037ULL;
+	for(size_t i=0; i<len; i++) {
+		hash^=(unsigned char)str[i];
+		hash*=1099511628211ULL;
+	}
+	return hash;
+}
+
+// A shell variable, entry holds "NAME=value" so exported ones can go to envp as they are.
+// cap is what entry has room for, a new value that fits is written over the old one
+typedef struct {
+	char* entry;
+	size_t cap;
+	size_t namelen;
+	size_t envidx;
+	bool exported;
+} Var;
+
+// Open addressing table of every shell variable, envp caches the exported ones
+// and is only rebuilt after one of them changed
+typedef struct {
+	Var* items;
+	size_t cap;
+	size_t len;
+	StrArr envp;
+	bool dirty;
+} VarTable;
+
+VarTable vars={0};
+
+void set_var(char* name,size_t len,char* value,bool export);
+
+Var* var_slot(char* name,size_t len) {
+	size_t mask=vars.cap-1;
+	for(size_t i=hash_str(name,len)&mask;; i=(i+1)&mask) {
+		Var* var=&vars.items[i];
+		if(var->entry==NULL) return var;
+		if(var->namelen==len && strncmp(var->entry,name,len)==0) return var;
+	}
+}
+
+void vars_grow(void) {
+	Var* old=vars.items;
+	size_t oldcap=vars.cap;
+	vars.cap=oldcap?oldcap*2:VAR_TABLE_INIT_CAP;
+	vars.items=calloc(vars.cap,sizeof(Var));
+	for(size_t i=0; i<oldcap; i++) {
+		if(old[i].entry) *var_slot(old[i].entry,old[i].namelen)=old[i];
+	}
+	free(old);
+}
+
+// The table starts as a copy of the environment the shell was started with
+void vars_import(void) {
+	vars_grow();
+	vars.dirty=true;
+	for(char** env=environ; *env; env++) {
+		char* eq=strchr(*env,'=');
+		if(eq) set_var(*env,eq-*env,eq+1,true);
+	}
+}
+
+Var* find_var(char* name,size_t len) {
+	if(vars.cap==0) vars_import();
+	Var* var=var_slot(name,len);
+	return var->entry?var:NULL;
+}
+
+char* lookup_var(char* name,size_t len) {
+	Var* var=find_var(name,len);
+	return var?var->entry+len+1:NULL;
+}
+
+char* get_var(char* name) {
+	return lookup_var(name,strlen(name));
+}
+
+// Assigns a variable, it becomes exported when export is set and keeps its flag otherwise
+void set_var(char* name,size_t len,char* value,bool export) {
+	if(vars.cap==0) vars_import();
+	if((vars.len+1)*2>vars.cap) vars_grow();
+	Var* var=var_slot(name,len);
+	if(var->entry && strcmp(var->entry+len+1,value)==0) {
+		if(export && !var->exported) vars.dirty=true;
+		var->exported|=export;
+		return;
+	}
+	size_t vlen=strlen(value);
+	if(var->entry && len+vlen+2<=var->cap) {
+		// value may point into the old one
+		memmove(var->entry+len+1,value,vlen+1);
+	} else {
+		size_t cap=len+vlen+2<VAR_ENTRY_MIN_CAP?VAR_ENTRY_MIN_CAP:len+vlen+2;
+		char* entry=malloc(cap);
+		memcpy(entry,name,len);
+		entry[len]='=';
+		memcpy(entry+len+1,value,vlen+1);
+		if(var->entry==NULL) {
+			var->namelen=len;
+			vars.len++;
+		}
+		free(var->entry);
+		var->entry=entry;
+		var->cap=cap;
+	}
+	var->exported|=export;
+	if(var->exported) vars.dirty=true;
+}
+
+void unset_var(char* name,size_t len) {
+	Var* var=find_var(name,len);
+	if(var==NULL) return;
+	if(var->exported) vars.dirty=true;
+	free(var->entry);
+	// backward shift deletion, like path_hash_remove
+	size_t mask=vars.cap-1;
+	size_t hole=var-vars.items;
+	for(size_t i=(hole+1)&mask; vars.items[i].entry; i=(i+1)&mask) {
+		size_t home=hash_str(vars.items[i].entry,vars.items[i].namelen)&mask;
+		if(((i-home)&mask)>=((i-hole)&mask)) {
+			vars.items[hole]=vars.items[i];
+			hole=i;
+		}
+	}
+	vars.items[hole]=(Var) {0};
+	vars.len--;
+}
+
+// Exported variables as an envp array, the slot before the terminating NULL is left for `_`
+char** exported_env(void) {
+	if(vars.cap==0) vars_import();
+	if(!vars.dirty) return vars.envp.items;
+	vars.envp.len=0;
+	for(size_t i=0; i<vars.cap; i++) {
+		Var* var=&vars.items[i];
+		if(var->entry==NULL || !var->exported || (var->namelen==1 && var->entry[0]=='_')) continue;
+		var->envidx=vars.envp.len;
+		da_append(&vars.envp,var->entry);
+	}
+	da_append(&vars.envp,NULL);
+	da_append(&vars.envp,NULL);
+	vars.dirty=false;
+	return vars.envp.items;
+}
+
+void command_output(Program* sub,Runner* parent,StrBuf* out,Arena* arena);
+
+// Appends the expansion of a word to parsedcmd, variables are first looked up in the
+// assignments made earlier in the same stage (vars holds their offsets in parsedcmd)
+// Substitutions run their commands with r (which may be NULL) as the shell around them
+bool expand_word(Program* prog,Word word,StrBuf* parsedcmd,StrArr vars,Arena* arena,Runner* r) {
+	size_t start=parsedcmd->len;
+	for(size_t i=0; i<word.len; i++) {
+		Part part=prog->parts.items[word.part+i];
+		char* str=prog->text.items+part.off;
+		char* value=NULL;
+		switch(part.kind) {
+			case PART_LIT:
+				for(size_t j=0; j<part.len; j++) arena_da_append(arena,parsedcmd,str[j]);
+				continue;
+			case PART_STATUS:
+				value=retbuf;
+				break;
+			case PART_HOME:
+				value=get_var("HOME");
+				if(value==NULL) value="~";
+				break;
+			case PART_SUBST:
+				command_output(prog->subs.items[part.off],r,parsedcmd,arena);
+				continue;
+			case PART_VAR:
+				for(size_t j=vars.len; j>0; j--) {
+					size_t varoff=(uintptr_t)vars.items[j-1];
+					if(strncmp(parsedcmd->items+varoff,str,part.len)!=0 || parsedcmd->items[varoff+part.len]!='=') continue;
+					for(size_t k=varoff+part.len+1; parsedcmd->items[k]!='\0'; k++) {
+						arena_da_append(arena,parsedcmd,parsedcmd->items[k]);
+					}
+					goto next_part;
+				}
+				value=lookup_var(str,part.len);
+				break;
+		}
+		if(value==NULL) continue;
+		for(size_t j=0; value[j]!='\0'; j++) arena_da_append(arena,parsedcmd,value[j]);
+next_part:
+		;
+	}
+	if(parsedcmd->len==start && !word.quoted) return false;
+	arena_da_append(arena,parsedcmd,'\0');
+	return true;
+}
+
+// Expands a compiled pipeline into cmds, everything they point to is allocated in arena
+void expand_pipeline(Program* prog,Pipeline pipeline,Cmds* cmds,Arena* arena,Runner* r) {
+	StrBuf parsedcmd={0};
+	cmds->items=arena_alloc(arena,pipeline.len*sizeof(Cmd));
+	cmds->cap=pipeline.len;
+	cmds->len=pipeline.len;
+	cmds->timed=pipeline.timed;
+	cmds->background=pipeline.background;
+	memset(cmds->items,0,pipeline.len*sizeof(Cmd));
+	// parsedcmd may move while growing, so offsets are stored until every word is expanded
+	for(size_t i=0; i<pipeline.len; i++) {
+		Stage stage=prog->stages.items[pipeline.stage+i];
+		Cmd* cmd=&cmds->items[i];
+		for(size_t j=0; j<stage.len; j++) {
+			char* off=(char*)(uintptr_t)parsedcmd.len;
+			if(!expand_word(prog,prog->words.items[stage.word+j],&parsedcmd,cmd->tmpvars,arena,r)) continue;
+			if(j<stage.nvars) arena_da_append(arena,&cmd->tmpvars,off);
+			else arena_da_append(arena,&cmd->current,off);
+		}
+		for(size_t j=0; j<stage.nredirs; j++) {
+			Redir redir=prog->redirs.items[stage.redir+j];
+			Redirect redirect={.kind=redir.kind,.fd=redir.fd,.src=redir.dupfd,.saved=-1};
+			if(redir.kind!=REDIR_DUP) {
+				// a target expanding to nothing stays NULL and is reported when opened
+				redirect.src=-1;
+				redirect.path=(char*)(uintptr_t)parsedcmd.len;
+				if(!expand_word(prog,redir.target,&parsedcmd,cmd->tmpvars,arena,r)) redirect.path=(char*)UINTPTR_MAX;
+			}
+			arena_da_append(arena,&cmd->redirects,redirect);
+		}
+	}
+	for(size_t i=0; i<pipeline.len; i++) {
+		Cmd* cmd=&cmds->items[i];
+		for(size_t j=0; j<cmd->tmpvars.len; j++) cmd->tmpvars.items[j]=parsedcmd.items+(uintptr_t)cmd->tmpvars.items[j];
+		for(size_t j=0; j<cmd->current.len; j++) cmd->current.items[j]=parsedcmd.items+(uintptr_t)cmd->current.items[j];
+		for(size_t j=0; j<cmd->redirects.len; j++) {
+			Redirect* redirect=&cmd->redirects.items[j];
+			if(redirect->kind==REDIR_DUP) continue;
+			redirect->path=(uintptr_t)redirect->path==UINTPTR_MAX?NULL:parsedcmd.items+(uintptr_t)redirect->path;
+		}
+		// keep argv NULL terminated for exec
+		arena_da_append(arena,&cmd->current,NULL);
+		cmd->current.len--;
+	}
+}
+
+// Maps the whole script and compiles it up front so a syntax error is reported
+// before anything runs
+bool load_script(Program* prog,char* filename) {
+	int fd=open(filename,O_RDONLY|O_CLOEXEC);
+	struct stat st;
+	if(fd<0 || fstat(fd,&st)<0) {
+		fprintf(stderr,"%s: %s: %s\n",pname,filename,strerror(errno));
+		if(fd>=0) close(fd);
+		return false;
+	}
+	if(st.st_size==0) {
+		close(fd);
+		return true;
+	}
+	char* data=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if(data==MAP_FAILED) {
+		fprintf(stderr,"%s: %s: %s\n",pname,filename,strerror(errno));
+		return false;
+	}
+	madvise(data,st.st_size,MADV_SEQUENTIAL);
+	bool ok=compile_text(prog,data,st.st_size,1,NULL,NULL);
+	munmap(data,st.st_size);
+	return ok;
+}
+
+typedef struct {
+	char* name;
+	char* path;
+	size_t hits;
+} PathHashEntry;
+
+// The PATH something was built from and the mtimes of its directories at the time
+typedef struct {
+	char* pathenv;
+	struct timespec* mtimes;
+	size_t ndirs;
+	time_t checked;
+} PathDirs;
+
+typedef struct {
+	PathHashEntry* items;
+	size_t cap;
+	size_t len;
+	PathDirs dirs;
+} PathHash;
+
+PathHash path_hash={0};
+
+void path_hash_clear(void) {
+	for(size_t i=0; i<path_hash.cap; i++) {
+		PathHashEntry* entry=&path_hash.items[i];
+		if(entry->name==NULL) continue;
+		free(entry->name);
+		free(entry->path);
+		entry->name=NULL;
+		entry->path=NULL;
+		entry->hits=0;
+	}
+	path_hash.len=0;
+}
+
+// Records the mtime of every PATH directory, a changed mtime means a command may have appeared or vanished
+bool path_dirs_stat(PathDirs* dirs,bool compare) {
+	bool changed=false;
+	size_t len=strlen(dirs->pathenv);
+	size_t dir=0;
+	size_t tlen=0;
+	char dirbuf[PATH_MAX];
+	for(size_t i=0; i<=len; i++) {
+		if(dirs->pathenv[i]!=':' && i!=len) {
+			tlen++;
+			continue;
+		}
+		snprintf(dirbuf,PATH_MAX,"%.*s",(int)tlen,dirs->pathenv+i-tlen);
+		tlen=0;
+		struct stat st;
+		struct timespec mtime={0};
+		if(stat(dirbuf,&st)==0) mtime=st.st_mtim;
+		if(dir>=dirs->ndirs) {
+			dirs->mtimes=realloc(dirs->mtimes,(dir+1)*sizeof(*dirs->mtimes));
+			dirs->ndirs=dir+1;
+			changed=true;
+		} else if(compare && (dirs->mtimes[dir].tv_sec!=mtime.tv_sec || dirs->mtimes[dir].tv_nsec!=mtime.tv_nsec)) {
+			changed=true;
+		}
+		dirs->mtimes[dir++]=mtime;
+	}
+	dirs->ndirs=dir;
+	return changed;
+}
+
+// Tells whether PATH changed or one of its directories was modified since the last call,
+// directory mtimes are rechecked at most once per second
+bool path_dirs_changed(PathDirs* dirs,char* pathenv) {
+	if(dirs->pathenv==NULL || strcmp(dirs->pathenv,pathenv)!=0) {
+		free(dirs->pathenv);
+		dirs->pathenv=strdup(pathenv);
+		path_dirs_stat(dirs,false);
+		dirs->checked=time(NULL);
+		return true;
+	}
+	time_t now=time(NULL);
+	if(now==dirs->checked) return false;
+	dirs->checked=now;
+	return path_dirs_stat(dirs,true);
+}
+
+// Drops every entry when the PATH directories changed
+void path_hash_validate(char* pathenv) {
+	if(path_dirs_changed(&path_hash.dirs,pathenv)) path_hash_clear();
+}
+
+PathHashEntry* path_hash_find(char* name) {
+	if(path_hash.cap==0) return NULL;
+	size_t mask=path_hash.cap-1;
+	for(size_t i=hash_str(name,strlen(name))&mask;; i=(i+1)&mask) {
+		PathHashEntry* entry=&path_hash.items[i];
+		if(entry->name==NULL) return entry;
+		if(strcmp(entry->name,name)==0) return entry;
+	}
+}
+
+void path_hash_insert(char* name,char* path) {
+	if((path_hash.len+1)*2>path_hash.cap) {
+		PathHashEntry* old=path_hash.items;
+		size_t oldcap=path_hash.cap;
+		path_hash.cap=oldcap?oldcap*2:PATH_HASH_INIT_CAP;
+		path_hash.items=calloc(path_hash.cap,sizeof(PathHashEntry));
+		for(size_t i=0; i<oldcap; i++) {
+			if(old[i].name) *path_hash_find(old[i].name)=old[i];
+		}
+		free(old);
+	}
+	PathHashEntry* entry=path_hash_find(name);
+	if(entry->name) {
+		free(entry->path);
+		entry->path=strdup(path);
+		return;
+	}
+	entry->name=strdup(name);
+	entry->path=strdup(path);
+	entry->hits=0;
+	path_hash.len++;
+}
+
+void path_hash_remove(char* name) {
+	PathHashEntry* entry=path_hash_find(name);
+	if(entry==NULL || entry->name==NULL) return;
+	free(entry->name);
+	free(entry->path);
+	// backward shift deletion so later probes in the cluster stay reachable
+	size_t mask=path_hash.cap-1;
+	size_t hole=entry-path_hash.items;
+	for(size_t i=(hole+1)&mask; path_hash.items[i].name; i=(i+1)&mask) {
+		size_t home=hash_str(path_hash.items[i].name,strlen(path_hash.items[i].name))&mask;
+		if(((i-home)&mask)>=((i-hole)&mask)) {
+			path_hash.items[hole]=path_hash.items[i];
+			hole=i;
+		}
+	}
+	path_hash.items[hole]=(PathHashEntry) {0};
+	path_hash.len--;
+}
+
+void expand_path(StrArr cmd,char* cwd,char* pathenv,char* pathbuf) {
+	if(pathenv==NULL) return;
+	if(cmd.len) {
+		size_t len=strlen(cmd.items[0]);
+		size_t tlen=0;
+		for(size_t i=0; i<len; i++) {
+			if(cmd.items[0][i]=='/') {
+				if(i==0) { // Absolute path
+					snprintf(pathbuf,PATH_MAX,"%s",cmd.items[0]);
+					pathbuf[PATH_MAX-1]='\0';
+					return;
+				}
+				// without a known cwd the relative path is left for execve to resolve
+				if(cwd[0]=='\0') snprintf(pathbuf,PATH_MAX,"%s",cmd.items[0]);
+				else snprintf(pathbuf,PATH_MAX,"%s/%s",cwd,cmd.items[0]);
+				pathbuf[PATH_MAX-1]='\0';
+				return;
+			}
+		}
+		path_hash_validate(pathenv);
+		PathHashEntry* cached=path_hash_find(cmd.items[0]);
+		if(cached && cached->name) {
+			cached->hits++;
+			snprintf(pathbuf,PATH_MAX,"%s",cached->path);
+			return;
+		}
+		len=strlen(pathenv);
+		for(size_t i=0; i<=len; i++) {
+			if(pathenv[i]==':' || i==len) {
+				snprintf(pathbuf,PATH_MAX,"%.*s/%s",(int)tlen,pathenv+i-tlen,cmd.items[0]);
+				pathbuf[PATH_MAX-1]='\0';
+				if(access(pathbuf,X_OK)==0) {
+					path_hash_insert(cmd.items[0],pathbuf);
+					path_hash_find(cmd.items[0])->hits++;
+					return;
+				}
+				tlen=0;
+				continue;
+			}
+			tlen++;
+		}
+		pathbuf[0]='\0';
+	}
+}
+
+void remove_dir(char* res,char* path) {
+	char* shortpath=path;
+	for(size_t i=0; path && path[i]; i++) {
+		if(path[i]=='/') {
+			shortpath=path+i+1;
+		}
+	}
+	strcpy(res,shortpath);
+}
+
+void getsize(int _sig) {
+	(void)_sig;
+	struct winsize win;
+	if(ioctl(0,TIOCGWINSZ,&win)<0 || win.ws_col==0) return;
+	term_width=win.ws_col;
+}
+
+// Edit buffer with the gap at the last edit position, the text is
+// items[0..start) followed by items[end..cap)
+typedef struct {
+	char* items;
+	size_t cap;
+	size_t start;
+	size_t end;
+} GapBuf;
+
+// Text split in two spans, so a GapBuf can be read without closing the gap
+typedef struct {
+	char* a;
+	size_t alen;
+	char* b;
+	size_t blen;
+} Text;
+
+size_t gap_len(GapBuf* g) {
+	return g->start+g->cap-g->end;
+}
+
+char gap_at(GapBuf* g,size_t i) {
+	return i<g->start?g->items[i]:g->items[g->end+i-g->start];
+}
+
+void gap_move(GapBuf* g,size_t idx) {
+	if(idx<g->start) {
+		size_t count=g->start-idx;
+		memmove(g->items+g->end-count,g->items+idx,count);
+		g->start-=count;
+		g->end-=count;
+	} else if(idx>g->start) {
+		size_t count=idx-g->start;
+		memmove(g->items+g->start,g->items+g->end,count);
+		g->start+=count;
+		g->end+=count;
+	}
+}
+
+void gap_insert(GapBuf* g,size_t idx,char* str,size_t len) {
+	gap_move(g,idx);
+	if(g->end-g->start<len) {
+		size_t tail=g->cap-g->end;
+		size_t cap=g->cap?g->cap*2:DA_INIT_CAP*16;
+		while(cap<gap_len(g)+len) cap*=2;
+		g->items=realloc(g->items,cap);
+		memmove(g->items+cap-tail,g->items+g->end,tail);
+		g->end=cap-tail;
+		g->cap=cap;
+	}
+	memcpy(g->items+g->start,str,len);
+	g->start+=len;
+}
+
+void gap_delete(GapBuf* g,size_t from,size_t to) {
+	gap_move(g,from);
+	g->end+=to-from;
+}
+
+void gap_set(GapBuf* g,char* str,size_t len) {
+	g->start=0;
+	g->end=g->cap;
+	gap_insert(g,0,str,len);
+}
+
+void gap_copy(GapBuf* g,size_t from,size_t to,StrBuf* out) {
+	for(size_t i=from; i<to; i++) da_append(out,gap_at(g,i));
+}
+
+Text gap_text(GapBuf* g) {
+	return (Text) {g->items,g->start,g->items+g->end,g->cap-g->end};
+}
+
+Text str_text(char* str,size_t len) {
+	return (Text) {str,len,NULL,0};
+}
+
+size_t text_len(Text text) {
+	return text.alen+text.blen;
+}
+
+char text_at(Text text,size_t i) {
+	return i<text.alen?text.a[i]:text.b[i-text.alen];
+}
+
+// Colors of the syntax highlighting, one per character of the line
+typedef enum {
+	STYLE_PLAIN,
+	STYLE_COMMAND,
+	STYLE_UNKNOWN,
+	STYLE_KEYWORD,
+	STYLE_STRING,
+	STYLE_VAR,
+	STYLE_OP,
+	STYLE_COMMENT,
+	STYLE_SUGGESTION,
+} Style;
+
+char* style_codes[]={
+	[STYLE_PLAIN]="\x1b[m",
+	[STYLE_COMMAND]="\x1b[0;34m",
+	[STYLE_UNKNOWN]="\x1b[0;31m",
+	[STYLE_KEYWORD]="\x1b[0;35m",
+	[STYLE_STRING]="\x1b[0;33m",
+	[STYLE_VAR]="\x1b[0;36m",
+	[STYLE_OP]="\x1b[0;32m",
+	[STYLE_COMMENT]="\x1b[0;90m",
+	[STYLE_SUGGESTION]="\x1b[0;2m",
+};
+
+// What the terminal currently shows of the line being edited, positions are in cells
+// counted from the first character of the prompt, styles goes along with shown
+typedef struct {
+	char* prompt;
+	size_t prompt_len;
+	StrBuf shown;
+	StrBuf styles;
+	size_t cursor;
+	StrBuf out;
+} Display;
+
+bool is_utf8_cont(char ch) {
+	return ((unsigned char)ch&0xc0)==0x80;
+}
+
+size_t cells(char* str,size_t len) {
+	size_t count=0;
+	for(size_t i=0; i<len; i++) {
+		if(!is_utf8_cont(str[i])) count++;
+	}
+	return count;
+}
+
+size_t text_cells(Text text,size_t from,size_t to) {
+	size_t count=0;
+	for(size_t i=from; i<to; i++) {
+		if(!is_utf8_cont(text_at(text,i))) count++;
+	}
+	return count;
+}
+
+// Width of a string on screen, skipping escape sequences
+size_t display_width(char* str) {
+	size_t width=0;
+	for(size_t i=0; str[i]; i++) {
+		if(str[i]=='\x1b' && str[i+1]=='[') {
+			for(i+=2; str[i] && !isalpha((unsigned char)str[i]); i++);
+			if(str[i]=='\0') break;
+			continue;
+		}
+		if(!is_utf8_cont(str[i])) width++;
+	}
+	return width;
+}
+
+void display_append(Display* d,char* str,size_t len) {
+	for(size_t i=0; i<len; i++) da_append(&d->out,str[i]);
+}
+
+void display_csi(Display* d,size_t count,char cmd) {
+	char buf[32];
+	int len=snprintf(buf,sizeof(buf),"\x1b[%zu%c",count,cmd);
+	display_append(d,buf,len);
+}
+
+void display_flush(Display* d) {
+	for(size_t done=0; done<d->out.len;) {
+		ssize_t count=write(STDOUT_FILENO,d->out.items+done,d->out.len-done);
+		if(count<0) {
+			if(errno==EINTR) continue;
+			break;
+		}
+		done+=count;
+	}
+	d->out.len=0;
+}
+
+void display_move(Display* d,size_t cell) {
+	size_t fromrow=d->cursor/term_width;
+	size_t torow=cell/term_width;
+	size_t fromcol=d->cursor%term_width;
+	size_t tocol=cell%term_width;
+	if(torow<fromrow) display_csi(d,fromrow-torow,'A');
+	if(torow>fromrow) display_csi(d,torow-fromrow,'B');
+	if(tocol<fromcol) display_csi(d,fromcol-tocol,'D');
+	if(tocol>fromcol) display_csi(d,tocol-fromcol,'C');
+	d->cursor=cell;
+}
+
+// Text that ends exactly on the right margin leaves the cursor in the pending
+// wrap state, move it to the next row so the cell arithmetic stays true
+void display_wrap(Display* d) {
+	if(d->cursor>0 && d->cursor%term_width==0) display_append(d,"\r\n",2);
+}
+
+// Starts drawing a new prompt where the cursor is
+void display_prompt(Display* d,char* prompt) {
+	d->prompt=prompt;
+	d->prompt_len=display_width(prompt);
+	d->shown.len=0;
+	d->styles.len=0;
+	display_append(d,"\r",1);
+	display_append(d,prompt,strlen(prompt));
+	display_append(d,"\x1b[J",3);
+	d->cursor=d->prompt_len;
+	display_wrap(d);
+}
+
+// Redraws the prompt in place, for when it changed
+void display_reprompt(Display* d,char* prompt) {
+	display_move(d,0);
+	display_prompt(d,prompt);
+}
+
+// Brings the screen in sync with text drawn in styles (NULL draws it plain) by rewriting
+// only what changed, everything is sent with a single write
+void display_refresh(Display* d,Text text,char* styles,size_t idx) {
+	size_t len=text_len(text);
+	size_t diff=0;
+	while(diff<len && diff<d->shown.len && text_at(text,diff)==d->shown.items[diff] && (styles?styles[diff]:STYLE_PLAIN)==d->styles.items[diff]) diff++;
+	if(diff<len || diff<d->shown.len) {
+		size_t oldcells=cells(d->shown.items,d->shown.len);
+		display_move(d,d->prompt_len+text_cells(text,0,diff));
+		d->shown.len=diff;
+		d->styles.len=diff;
+		char style=STYLE_PLAIN;
+		for(size_t i=diff; i<len; i++) {
+			char next=styles?styles[i]:STYLE_PLAIN;
+			if(next!=style) display_append(d,style_codes[(int)next],strlen(style_codes[(int)next]));
+			style=next;
+			da_append(&d->shown,text_at(text,i));
+			da_append(&d->styles,style);
+			da_append(&d->out,text_at(text,i));
+		}
+		if(style!=STYLE_PLAIN) display_append(d,style_codes[STYLE_PLAIN],strlen(style_codes[STYLE_PLAIN]));
+		d->cursor+=text_cells(text,diff,len);
+		if(diff<len) display_wrap(d);
+		if(cells(d->shown.items,len)<oldcells) display_append(d,"\x1b[J",3);
+	}
+	display_move(d,d->prompt_len+text_cells(text,0,idx));
+	display_flush(d);
+}
+
+// Leaves the cursor on a fresh row below the edited line
+void display_finish(Display* d) {
+	display_move(d,d->prompt_len+cells(d->shown.items,d->shown.len));
+	if(d->cursor%term_width!=0 || d->cursor==0) display_append(d,"\r\n",2);
+	display_flush(d);
+}
+
+typedef struct {
+	uint32_t* items;
+	size_t cap;
+	size_t len;
+} Postings;
+
+// Trigram index over the history, each posting list holds entry indices in ascending order
+typedef struct {
+	uint32_t* keys;
+	Postings* postings;
+	size_t cap;
+	size_t len;
+} HistIndex;
+
+HistIndex hist_index={0};
+
+uint32_t trigram(char* str) {
+	return (uint32_t)tolower((unsigned char)str[0])<<16 | (uint32_t)tolower((unsigned char)str[1])<<8 | (uint32_t)tolower((unsigned char)str[2]);
+}
+
+Postings* hist_index_get(uint32_t key,bool create) {
+	if(hist_index.cap==0 || (create && (hist_index.len+1)*2>hist_index.cap)) {
+		if(!create) return NULL;
+		HistIndex old=hist_index;
+		hist_index.cap=old.cap?old.cap*2:HIST_INDEX_INIT_CAP;
+		hist_index.keys=calloc(hist_index.cap,sizeof(uint32_t));
+		hist_index.postings=calloc(hist_index.cap,sizeof(Postings));
+		for(size_t i=0; i<old.cap; i++) {
+			if(old.keys[i]==0) continue;
+			size_t j=old.keys[i]*2654435761u&(hist_index.cap-1);
+			while(hist_index.keys[j]) j=(j+1)&(hist_index.cap-1);
+			hist_index.keys[j]=old.keys[i];
+			hist_index.postings[j]=old.postings[i];
+		}
+		free(old.keys);
+		free(old.postings);
+	}
+	size_t mask=hist_index.cap-1;
+	for(size_t i=key*2654435761u&mask;; i=(i+1)&mask) {
+		if(hist_index.keys[i]==key) return &hist_index.postings[i];
+		if(hist_index.keys[i]) continue;
+		if(!create) return NULL;
+		hist_index.keys[i]=key;
+		hist_index.len++;
+		return &hist_index.postings[i];
+	}
+}
+
+void hist_index_add(char* entry,size_t len,uint32_t idx) {
+	for(size_t i=0; i+3<=len; i++) {
+		Postings* postings=hist_index_get(trigram(entry+i),true);
+		if(postings->len && postings->items[postings->len-1]==idx) continue;
+		da_append(postings,idx);
+	}
+}
+
+// Radix tree over the history for suggestions, where every node knows the most recent
+// entry below it. The edge into a node is spelled by its entry from the parent's depth
+// up to its own, so the tree keeps no text of its own. Node 0 is the root, which makes
+// 0 free to mean no child or sibling
+typedef struct {
+	uint32_t entry;
+	uint32_t depth;
+	uint32_t latest;
+	uint32_t child;
+	uint32_t sibling;
+} PrefixNode;
+
+typedef struct {
+	PrefixNode* items;
+	size_t cap;
+	size_t len;
+} PrefixTree;
+
+PrefixTree hist_prefix={0};
+
+uint32_t prefix_node(uint32_t entry,uint32_t depth,uint32_t latest) {
+	da_append(&hist_prefix,((PrefixNode) {.entry=entry,.depth=depth,.latest=latest}));
+	return hist_prefix.len-1;
+}
+
+// The child of node whose edge starts with ch, 0 when there is none
+uint32_t prefix_child(char** entries,uint32_t node,char ch) {
+	uint32_t depth=hist_prefix.items[node].depth;
+	for(uint32_t c=hist_prefix.items[node].child; c; c=hist_prefix.items[c].sibling) {
+		if(entries[hist_prefix.items[c].entry][depth]==ch) return c;
+	}
+	return 0;
+}
+
+// Adds entry idx, whose text is not in entries yet
+void hist_prefix_add(char** entries,char* entry,size_t len,uint32_t idx) {
+	if(hist_prefix.len==0) prefix_node(idx,0,idx);
+	uint32_t node=0;
+	hist_prefix.items[node].latest=idx;
+	while(hist_prefix.items[node].depth<len) {
+		uint32_t depth=hist_prefix.items[node].depth;
+		uint32_t c=prefix_child(entries,node,entry[depth]);
+		if(c==0) {
+			uint32_t leaf=prefix_node(idx,len,idx);
+			hist_prefix.items[leaf].sibling=hist_prefix.items[node].child;
+			hist_prefix.items[node].child=leaf;
+			return;
+		}
+		char* label=entries[hist_prefix.items[c].entry];
+		uint32_t split=depth+1;
+		while(split<hist_prefix.items[c].depth && split<len && label[split]==entry[split]) split++;
+		if(split<hist_prefix.items[c].depth) {
+			// entry leaves the edge halfway, so a node goes in where it does
+			uint32_t mid=prefix_node(hist_prefix.items[c].entry,split,idx);
+			PrefixNode* items=hist_prefix.items;
+			items[mid].child=c;
+			items[mid].sibling=items[c].sibling;
+			items[c].sibling=0;
+			if(items[node].child==c) {
+				items[node].child=mid;
+			} else {
+				uint32_t prev=items[node].child;
+				while(items[prev].sibling!=c) prev=items[prev].sibling;
+				items[prev].sibling=mid;
+			}
+			c=mid;
+		}
+		hist_prefix.items[c].latest=idx;
+		node=c;
+	}
+}
+
+// The most recent entry that starts with the len bytes of prefix and goes on past them,
+// NULL when there is none
+char* hist_prefix_find(char** entries,char* prefix,size_t len) {
+	if(hist_prefix.len==0 || len==0) return NULL;
+	uint32_t node=0;
+	while(hist_prefix.items[node].depth<len) {
+		uint32_t depth=hist_prefix.items[node].depth;
+		uint32_t c=prefix_child(entries,node,prefix[depth]);
+		if(c==0) return NULL;
+		char* label=entries[hist_prefix.items[c].entry];
+		for(size_t i=depth+1; i<hist_prefix.items[c].depth && i<len; i++) {
+			if(label[i]!=prefix[i]) return NULL;
+		}
+		node=c;
+	}
+	if(hist_prefix.items[node].depth>len) return entries[hist_prefix.items[node].latest];
+	// entries equal to prefix end right here, the longer ones are below
+	uint32_t best=0;
+	for(uint32_t c=hist_prefix.items[node].child; c; c=hist_prefix.items[c].sibling) {
+		if(best==0 || hist_prefix.items[c].latest>hist_prefix.items[best].latest) best=c;
+	}
+	return best?entries[hist_prefix.items[best].latest]:NULL;
+}
+
+// Substring search, case insensitive unless the needle has uppercase letters
+char* find_match(char* haystack,char* needle,size_t nlen,bool icase) {
+	for(char* start=haystack; *start; start++) {
+		size_t i=0;
+		if(icase) {
+			while(i<nlen && start[i] && tolower((unsigned char)start[i])==needle[i]) i++;
+		} else {
+			while(i<nlen && start[i]==needle[i]) i++;
+		}
+		if(i==nlen) return start;
+	}
+	return NULL;
+}
+
+// Finds the most recent distinct entries containing query and orders them by match
+// quality (whole entry, prefix, word start) with recency breaking ties
+size_t search_history(StrArr history,char* query,size_t qlen,size_t* results) {
+	if(qlen==0 || history.len==0) return 0;
+	bool icase=true;
+	for(size_t i=0; i<qlen && icase; i++) icase=!isupper((unsigned char)query[i]);
+	Postings* rarest=NULL;
+	for(size_t i=0; i+3<=qlen; i++) {
+		Postings* postings=hist_index_get(trigram(query+i),false);
+		if(postings==NULL || postings->len==0) return 0;
+		if(rarest==NULL || postings->len<rarest->len) rarest=postings;
+	}
+	int scores[SEARCH_MAX_RESULTS];
+	size_t count=0;
+	size_t ncandidates=rarest?rarest->len:history.len;
+	for(size_t c=ncandidates; c>0 && count<SEARCH_MAX_RESULTS; c--) {
+		size_t idx=rarest?rarest->items[c-1]:c-1;
+		char* entry=history.items[idx];
+		char* match=find_match(entry,query,qlen,icase);
+		if(match==NULL) continue;
+		bool duplicate=false;
+		for(size_t i=0; i<count && !duplicate; i++) duplicate=strcmp(history.items[results[i]],entry)==0;
+		if(duplicate) continue;
+		int score=-(int)count;
+		if(match==entry) score+=SEARCH_MAX_RESULTS;
+		if(match==entry && entry[qlen]=='\0') score+=SEARCH_MAX_RESULTS;
+		if(match==entry || isspace((unsigned char)match[-1]) || match[-1]=='/') score+=SEARCH_MAX_RESULTS/2;
+		size_t pos=count++;
+		while(pos>0 && scores[pos-1]<score) {
+			scores[pos]=scores[pos-1];
+			results[pos]=results[pos-1];
+			pos--;
+		}
+		scores[pos]=score;
+		results[pos]=idx;
+	}
+	return count;
+}
+
+typedef enum {
+	JOB_RUNNING,
+	JOB_STOPPED,
+	JOB_DONE,
+} JobState;
+
+typedef struct {
+	pid_t pid;
+	int status;
+	bool exited;
+	bool stopped;
+} JobProc;
+
+// A pipeline the shell is not waiting for, either started with & or stopped with C-z
+typedef struct {
+	size_t id;
+	pid_t pgid;
+	char* command;
+	JobProc* procs;
+	size_t nprocs;
+	JobState state;
+	bool notify;
+	bool has_tmodes;
+	Termios tmodes;
+} Job;
+
+typedef struct {
+	Job* items;
+	size_t cap;
+	size_t len;
+} Jobs;
+
+Jobs jobs={0};
+bool interactive=false;
+// The file the shell reads its commands from when they are piped in, set only in that case
+struct stat script_stdin;
+bool script_on_stdin=false;
+// SIGCHLD is blocked and read from sigchld_fd, which event_fd waits on together with keys_fd
+int sigchld_fd=-1;
+int event_fd=-1;
+sigset_t shell_sigmask;
+// Signals the shell ignores for itself, its children get the default action back
+sigset_t ignored_signals;
+// C-c while the shell itself has the terminal, only running builtins, is noted here
+volatile sig_atomic_t sigint_caught=0;
+
+sigset_t sigchld_set(void) {
+	sigset_t chld;
+	sigemptyset(&chld);
+	sigaddset(&chld,SIGCHLD);
+	return chld;
+}
+
+// How a signal was handled before ignore_signal changed that
+typedef struct {
+	struct sigaction action;
+	bool ignored;
+} SignalState;
+
+// The shell ignores sig while the children it starts get the default back, what was
+// there before goes to old when given so that restore_signal can put it back
+void ignore_signal(int sig,SignalState* old) {
+	struct sigaction action={.sa_handler=SIG_IGN};
+	sigemptyset(&action.sa_mask);
+	if(old) old->ignored=sigismember(&ignored_signals,sig)==1;
+	sigaddset(&ignored_signals,sig);
+	sigaction(sig,&action,old?&old->action:NULL);
+}
+
+void restore_signal(int sig,SignalState* old) {
+	if(!old->ignored) sigdelset(&ignored_signals,sig);
+	sigaction(sig,&old->action,NULL);
+}
+
+void on_sigint(int _sig) {
+	(void)_sig;
+	sigint_caught=1;
+}
+
+// SIGINT counts as ignored for the children but the shell keeps a handler, without
+// SA_RESTART so that a wait it is blocked in returns
+void catch_sigint(void) {
+	sigaddset(&ignored_signals,SIGINT);
+	struct sigaction action={.sa_handler=on_sigint};
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT,&action,NULL);
+}
+
+void shell_signals(void) {
+	sigset_t chld=sigchld_set();
+	sigprocmask(SIG_BLOCK,&chld,NULL);
+	for(int sig=1; sig<NSIG; sig++) {
+		if(sigismember(&ignored_signals,sig)==1) signal(sig,SIG_IGN);
+	}
+	if(interactive) catch_sigint();
+}
+
+void events_init(bool watch_keys) {
+	sigset_t chld=sigchld_set();
+	sigprocmask(SIG_BLOCK,&chld,&shell_sigmask);
+	sigchld_fd=signalfd(-1,&chld,SFD_NONBLOCK|SFD_CLOEXEC);
+	event_fd=epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event event={.events=EPOLLIN,.data.fd=sigchld_fd};
+	epoll_ctl(event_fd,EPOLL_CTL_ADD,sigchld_fd,&event);
+	if(!watch_keys) return;
+	event.data.fd=keys_fd;
+	epoll_ctl(event_fd,EPOLL_CTL_ADD,keys_fd,&event);
+}
+
+// Puts the signal mask back the way the shell found it, for processes about to exec
+void restore_sigmask(void) {
+	sigprocmask(SIG_SETMASK,&shell_sigmask,NULL);
+	for(int sig=1; sig<NSIG; sig++) {
+		if(sigismember(&ignored_signals,sig)==1) signal(sig,SIG_DFL);
+	}
+}
+
+// Builds the line shown by jobs from the expanded arguments of every stage
+char* job_command(Cmds* cmds) {
+	StrBuf command={0};
+	for(size_t i=0; i<cmds->len; i++) {
+		if(i) for(char* sep=" | "; *sep; sep++) da_append(&command,*sep);
+		for(size_t j=0; j<cmds->items[i].current.len; j++) {
+			if(j) da_append(&command,' ');
+			for(char* arg=cmds->items[i].current.items[j]; *arg; arg++) da_append(&command,*arg);
+		}
+	}
+	da_append(&command,'\0');
+	return command.items;
+}
+
+void update_job_state(Job* job) {
+	JobState state=JOB_DONE;
+	for(size_t i=0; i<job->nprocs; i++) {
+		if(job->procs[i].exited) continue;
+		if(!job->procs[i].stopped) state=JOB_RUNNING;
+		else if(state==JOB_DONE) state=JOB_STOPPED;
+	}
+	if(state!=job->state) job->notify=true;
+	job->state=state;
+}
+
+// Records the processes of cmds that are still alive as a new job
+Job* add_job(Cmds* cmds,JobState state) {
+	Job job={.id=jobs.len?jobs.items[jobs.len-1].id+1:1,.state=state};
+	job.procs=malloc(cmds->len*sizeof(JobProc));
+	for(size_t i=0; i<cmds->len; i++) {
+		if(cmds->items[i].pid<=0) continue;
+		if(job.pgid==0) job.pgid=cmds->items[i].pid;
+		job.procs[job.nprocs++]=(JobProc) {.pid=cmds->items[i].pid,.stopped=state==JOB_STOPPED};
+	}
+	if(job.nprocs==0) {
+		free(job.procs);
+		return NULL;
+	}
+	job.command=job_command(cmds);
+	da_append(&jobs,job);
+	return &jobs.items[jobs.len-1];
+}
+
+void remove_job(Job* job) {
+	free(job->command);
+	free(job->procs);
+	size_t idx=job-jobs.items;
+	memmove(job,job+1,(jobs.len-idx-1)*sizeof(Job));
+	jobs.len--;
+}
+
+// Exit code of a job, taken from its last stage like for foreground pipelines
+int job_exit_code(Job* job) {
+	int status=job->procs[job->nprocs-1].status;
+	if(WIFSIGNALED(status)) return 128+WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
+
+void update_job(pid_t pid,int status) {
+	for(size_t i=0; i<jobs.len; i++) {
+		Job* job=&jobs.items[i];
+		for(size_t j=0; j<job->nprocs; j++) {
+			JobProc* proc=&job->procs[j];
+			if(proc->pid!=pid) continue;
+			if(WIFSTOPPED(status)) {
+				proc->stopped=true;
+			} else if(WIFCONTINUED(status)) {
+				proc->stopped=false;
+			} else {
+				proc->exited=true;
+				proc->status=status;
+			}
+			update_job_state(job);
+			return;
+		}
+	}
+}
+
+// Collects every child that changed state without blocking, returns whether a job
+// has something to report
+bool reap_jobs(void) {
+	struct signalfd_siginfo info;
+	while(read(sigchld_fd,&info,sizeof(info))>0);
+	int status;
+	pid_t pid;
+	while((pid=waitpid(-1,&status,WNOHANG|WUNTRACED|WCONTINUED))>0) update_job(pid,status);
+	for(size_t i=0; i<jobs.len; i++) {
+		if(jobs.items[i].notify) return true;
+	}
+	return false;
+}
+
+void print_job(Job* job) {
+	char state[32];
+	switch(job->state) {
+		case JOB_RUNNING:
+			snprintf(state,sizeof(state),"Running");
+			break;
+		case JOB_STOPPED:
+			snprintf(state,sizeof(state),"Stopped");
+			break;
+		case JOB_DONE:
+			if(WIFSIGNALED(job->procs[job->nprocs-1].status)) snprintf(state,sizeof(state),"%s",strsignal(WTERMSIG(job->procs[job->nprocs-1].status)));
+			else if(job_exit_code(job)) snprintf(state,sizeof(state),"Exit %d",job_exit_code(job));
+			else snprintf(state,sizeof(state),"Done");
+			break;
+	}
+	fprintf(stderr,"[%zu]  %-12s %s\n",job->id,state,job->command);
+}
+
+// Prints the jobs whose state changed (or all of them) and forgets the finished ones
+void report_jobs(bool all) {
+	for(size_t i=0; i<jobs.len;) {
+		Job* job=&jobs.items[i];
+		if(all || job->notify) print_job(job);
+		job->notify=false;
+		if(job->state==JOB_DONE) remove_job(job);
+		else i++;
+	}
+}
+
+// Names of every executable in PATH for completion, filled by a scanner child that
+// writes them NUL separated to fd so a slow directory never holds up the line editor
+typedef struct {
+	StrBuf text;
+	Offsets names;
+	bool sorted;
+	StrBuf pending;
+	pid_t scanner;
+	int fd;
+	PathDirs dirs;
+} CmdIndex;
+
+CmdIndex cmd_index={.fd=-1};
+
+void cmd_index_scan(char* pathenv,int out) {
+	StrBuf buf={0};
+	size_t len=strlen(pathenv);
+	size_t tlen=0;
+	char dirbuf[PATH_MAX];
+	for(size_t i=0; i<=len; i++) {
+		if(pathenv[i]!=':' && i!=len) {
+			tlen++;
+			continue;
+		}
+		snprintf(dirbuf,PATH_MAX,"%.*s",(int)tlen,pathenv+i-tlen);
+		tlen=0;
+		DIR* dir=opendir(dirbuf);
+		if(dir==NULL) continue;
+		struct dirent* entry;
+		while((entry=readdir(dir))) {
+			if(entry->d_name[0]=='.') continue;
+			if(entry->d_type!=DT_REG && entry->d_type!=DT_LNK && entry->d_type!=DT_UNKNOWN) continue;
+			struct stat st;
+			if(fstatat(dirfd(dir),entry->d_name,&st,0)<0 || !S_ISREG(st.st_mode)) continue;
+			if(faccessat(dirfd(dir),entry->d_name,X_OK,0)<0) continue;
+			for(char* ch=entry->d_name; *ch; ch++) da_append(&buf,*ch);
+			da_append(&buf,'\0');
+		}
+		closedir(dir);
+		// one write per directory, the shell picks the names up as they come
+		for(size_t done=0; done<buf.len;) {
+			ssize_t count=write(out,buf.items+done,buf.len-done);
+			if(count<0 && errno==EINTR) continue;
+			if(count<0) _exit(1);
+			done+=count;
+		}
+		buf.len=0;
+	}
+	_exit(0);
+}
+
+void cmd_index_stop(void) {
+	if(cmd_index.fd<0) return;
+	epoll_ctl(event_fd,EPOLL_CTL_DEL,cmd_index.fd,NULL);
+	close(cmd_index.fd);
+	// only a scanner that was not reaped yet can be killed without hitting a reused pid
+	if(waitpid(cmd_index.scanner,NULL,WNOHANG)==0) kill(cmd_index.scanner,SIGKILL);
+	cmd_index.fd=-1;
+}
+
+// Starts over in the background when PATH or one of its directories changed
+void cmd_index_refresh(void) {
+	char* pathenv=get_var("PATH");
+	if(pathenv==NULL || event_fd<0 || !path_dirs_changed(&cmd_index.dirs,pathenv)) return;
+	cmd_index_stop();
+	int fds[2];
+	if(pipe(fds)<0) return;
+	pid_t pid=fork();
+	if(pid<0) {
+		close(fds[0]);
+		close(fds[1]);
+		return;
+	}
+	if(pid==0) {
+		close(fds[0]);
+		cmd_index_scan(pathenv,fds[1]);
+	}
+	close(fds[1]);
+	fcntl(fds[0],F_SETFD,FD_CLOEXEC);
+	fcntl(fds[0],F_SETFL,O_NONBLOCK);
+	cmd_index.scanner=pid;
+	cmd_index.fd=fds[0];
+	cmd_index.text.len=0;
+	cmd_index.names.len=0;
+	cmd_index.pending.len=0;
+	struct epoll_event event={.events=EPOLLIN,.data.fd=fds[0]};
+	epoll_ctl(event_fd,EPOLL_CTL_ADD,fds[0],&event);
+}
+
+// Takes in whatever the scanner wrote so far
+void cmd_index_read(void) {
+	char block[4096];
+	ssize_t count;
+	while((count=read(cmd_index.fd,block,sizeof(block)))!=0) {
+		if(count<0) {
+			if(errno==EINTR) continue;
+			if(errno==EAGAIN) return;
+			break;
+		}
+		for(ssize_t i=0; i<count; i++) {
+			da_append(&cmd_index.pending,block[i]);
+			if(block[i]!='\0') continue;
+			da_append(&cmd_index.names,cmd_index.text.len);
+			for(size_t j=0; j<cmd_index.pending.len; j++) da_append(&cmd_index.text,cmd_index.pending.items[j]);
+			cmd_index.pending.len=0;
+		}
+		cmd_index.sorted=false;
+	}
+	epoll_ctl(event_fd,EPOLL_CTL_DEL,cmd_index.fd,NULL);
+	close(cmd_index.fd);
+	cmd_index.fd=-1;
+}
+
+int compare_names(const void* a,const void* b) {
+	return strcmp(cmd_index.text.items+*(size_t*)a,cmd_index.text.items+*(size_t*)b);
+}
+
+void cmd_index_sort(void) {
+	if(cmd_index.sorted) return;
+	qsort(cmd_index.names.items,cmd_index.names.len,sizeof(size_t),compare_names);
+	size_t kept=0;
+	for(size_t i=0; i<cmd_index.names.len; i++) {
+		if(kept && strcmp(cmd_index.text.items+cmd_index.names.items[kept-1],cmd_index.text.items+cmd_index.names.items[i])==0) continue;
+		cmd_index.names.items[kept++]=cmd_index.names.items[i];
+	}
+	cmd_index.names.len=kept;
+	cmd_index.sorted=true;
+}
+
+// First indexed name not sorting before the first len bytes of prefix
+size_t cmd_index_find(char* prefix,size_t len) {
+	cmd_index_sort();
+	size_t lo=0;
+	size_t hi=cmd_index.names.len;
+	while(lo<hi) {
+		size_t mid=(lo+hi)/2;
+		if(strncmp(cmd_index.text.items+cmd_index.names.items[mid],prefix,len)<0) lo=mid+1;
+		else hi=mid;
+	}
+	return lo;
+}
+
+bool cmd_index_has(char* name) {
+	size_t i=cmd_index_find(name,strlen(name)+1);
+	return i<cmd_index.names.len && strcmp(cmd_index.text.items+cmd_index.names.items[i],name)==0;
+}
+
+// Calls fn for every indexed command starting with prefix, in order and once per name
+void cmd_index_match(char* prefix,size_t len,void (*fn)(char* name)) {
+	for(size_t i=cmd_index_find(prefix,len); i<cmd_index.names.len; i++) {
+		char* name=cmd_index.text.items+cmd_index.names.items[i];
+		if(strncmp(name,prefix,len)!=0) break;
+		fn(name);
+	}
+}
+
+// Git branch of the repository the shell is in for the prompt, worked out by a git child
+// so a big or slow repository never holds up the prompt, which is repainted once it answers.
+// Answers are kept per repository until HEAD or the index change or they get old
+typedef struct {
+	char* root;
+	struct timespec head;
+	struct timespec index;
+	time_t computed;
+	char* text;
+} GitSegment;
+
+typedef struct {
+	GitSegment* items;
+	size_t cap;
+	size_t len;
+	size_t current;
+	size_t computing;
+	struct timespec head;
+	struct timespec index;
+	StrBuf out;
+	bool dirty;
+	pid_t pid;
+	int fd;
+} GitPrompt;
+
+GitPrompt git_prompt={.current=SIZE_MAX,.computing=SIZE_MAX,.fd=-1};
+
+bool same_mtime(struct timespec a,struct timespec b) {
+	return a.tv_sec==b.tv_sec && a.tv_nsec==b.tv_nsec;
+}
+
+// Walks up from cwd to the repository, root is its top directory and gitdir the one
+// holding HEAD, which worktrees and submodules point to from a .git file
+bool git_find(char* cwd,char* root,char* gitdir) {
+	snprintf(root,PATH_MAX,"%s",cwd);
+	while(1) {
+		size_t len=strlen(root);
+		if(len+5<PATH_MAX) {
+			snprintf(gitdir,PATH_MAX,"%s/.git",len==1?"":root);
+			struct stat st;
+			if(stat(gitdir,&st)==0) {
+				if(S_ISDIR(st.st_mode)) return true;
+				int fd=open(gitdir,O_RDONLY|O_CLOEXEC);
+				if(fd<0) return false;
+				char buf[PATH_MAX];
+				ssize_t count=read(fd,buf,sizeof(buf)-1);
+				close(fd);
+				if(count<8 || strncmp(buf,"gitdir: ",8)!=0) return false;
+				while(count>8 && isspace((unsigned char)buf[count-1])) count--;
+				buf[count]='\0';
+				if(buf[8]=='/') snprintf(gitdir,PATH_MAX,"%s",buf+8);
+				else if(len+count-8+1<PATH_MAX) snprintf(gitdir,PATH_MAX,"%s/%s",root,buf+8);
+				else return false;
+				return true;
+			}
+		}
+		char* slash=strrchr(root,'/');
+		if(slash==NULL || len==1) return false;
+		slash[slash==root]='\0';
+	}
+}
+
+void git_prompt_stop(void) {
+	if(git_prompt.fd<0) return;
+	epoll_ctl(event_fd,EPOLL_CTL_DEL,git_prompt.fd,NULL);
+	close(git_prompt.fd);
+	if(waitpid(git_prompt.pid,NULL,WNOHANG)==0) kill(git_prompt.pid,SIGKILL);
+	git_prompt.fd=-1;
+	git_prompt.computing=SIZE_MAX;
+}
+
+// Picks the segment for cwd and asks git again when there is none yet or it went stale,
+// the old text is shown meanwhile
+void git_prompt_refresh(char* cwd) {
+	git_prompt.current=SIZE_MAX;
+	char root[PATH_MAX];
+	char gitdir[PATH_MAX];
+	if(event_fd<0 || !git_find(cwd,root,gitdir)) return;
+	char name[PATH_MAX+8];
+	struct stat st;
+	struct timespec head={0};
+	struct timespec index={0};
+	snprintf(name,sizeof(name),"%s/HEAD",gitdir);
+	if(stat(name,&st)==0) head=st.st_mtim;
+	snprintf(name,sizeof(name),"%s/index",gitdir);
+	if(stat(name,&st)==0) index=st.st_mtim;
+	size_t i=0;
+	while(i<git_prompt.len && strcmp(git_prompt.items[i].root,root)!=0) i++;
+	if(i==git_prompt.len) da_append(&git_prompt,((GitSegment) {.root=strdup(root)}));
+	GitSegment* seg=&git_prompt.items[i];
+	git_prompt.current=i;
+	if(seg->text && same_mtime(seg->head,head) && same_mtime(seg->index,index) && time(NULL)-seg->computed<GIT_PROMPT_TTL) return;
+	if(git_prompt.fd>=0 && git_prompt.computing==i) return;
+	git_prompt_stop();
+	int fds[2];
+	if(pipe(fds)<0) return;
+	pid_t pid=fork();
+	if(pid<0) {
+		close(fds[0]);
+		close(fds[1]);
+		return;
+	}
+	if(pid==0) {
+		// untracked files are left out, looking for them is what makes status slow
+		char* args[]={"git","-C",root,"--no-optional-locks","status","--porcelain","--branch","--untracked-files=no",NULL};
+		char resolved[PATH_MAX]="";
+		expand_path((StrArr) {.items=args,.len=1},"",get_var("PATH"),resolved);
+		int devnull=open("/dev/null",O_RDWR);
+		dup2(devnull,STDIN_FILENO);
+		dup2(fds[1],STDOUT_FILENO);
+		dup2(devnull,STDERR_FILENO);
+		restore_sigmask();
+		if(resolved[0]) execve(resolved,args,exported_env());
+		_exit(127);
+	}
+	close(fds[1]);
+	fcntl(fds[0],F_SETFD,FD_CLOEXEC);
+	fcntl(fds[0],F_SETFL,O_NONBLOCK);
+	git_prompt.pid=pid;
+	git_prompt.fd=fds[0];
+	git_prompt.computing=i;
+	git_prompt.head=head;
+	git_prompt.index=index;
+	git_prompt.out.len=0;
+	git_prompt.dirty=false;
+	struct epoll_event event={.events=EPOLLIN,.data.fd=fds[0]};
+	epoll_ctl(event_fd,EPOLL_CTL_ADD,fds[0],&event);
+}
+
+// The branch from the first line of git status --branch, with a * when anything changed
+char* git_status_text(StrBuf* out,bool dirty) {
+	char* line=out->items;
+	size_t len=out->len;
+	if(len<3 || strncmp(line,"## ",3)!=0) return strdup("");
+	line+=3;
+	len-=3;
+	char* unborn[]={"No commits yet on ","Initial commit on "};
+	for(size_t i=0; i<2; i++) {
+		size_t plen=strlen(unborn[i]);
+		if(len>=plen && strncmp(line,unborn[i],plen)==0) {
+			line+=plen;
+			len-=plen;
+		}
+	}
+	// the upstream follows after ..., a detached HEAD after a space
+	for(size_t i=0; i<len; i++) {
+		if(line[i]=='\n' || line[i]==' ' || (i+2<len && strncmp(line+i,"...",3)==0)) len=i;
+	}
+	char* text=malloc(len+2);
+	snprintf(text,len+2,"%.*s%s",(int)len,line,dirty?"*":"");
+	return text;
+}
+
+// Takes in what git wrote so far, true when it finished and changed the segment shown
+bool git_prompt_read(void) {
+	char block[4096];
+	ssize_t count;
+	while((count=read(git_prompt.fd,block,sizeof(block)))!=0) {
+		if(count<0) {
+			if(errno==EINTR) continue;
+			if(errno==EAGAIN) return false;
+			break;
+		}
+		// only the branch line is kept, any line after it is a change
+		for(ssize_t i=0; i<count && !git_prompt.dirty; i++) {
+			if(git_prompt.out.len && git_prompt.out.items[git_prompt.out.len-1]=='\n') git_prompt.dirty=true;
+			else da_append(&git_prompt.out,block[i]);
+		}
+	}
+	epoll_ctl(event_fd,EPOLL_CTL_DEL,git_prompt.fd,NULL);
+	close(git_prompt.fd);
+	git_prompt.fd=-1;
+	GitSegment* seg=&git_prompt.items[git_prompt.computing];
+	char* old=seg->text;
+	seg->text=git_status_text(&git_prompt.out,git_prompt.dirty);
+	seg->head=git_prompt.head;
+	seg->index=git_prompt.index;
+	seg->computed=time(NULL);
+	bool changed=git_prompt.computing==git_prompt.current && (old==NULL || strcmp(old,seg->text)!=0);
+	git_prompt.computing=SIZE_MAX;
+	free(old);
+	return changed;
+}
+
+// The segment for the directory of the last refresh, NULL outside a repository
+char* git_prompt_text(void) {
+	if(git_prompt.current==SIZE_MAX) return NULL;
+	return git_prompt.items[git_prompt.current].text;
+}
+
+// The main prompt and what it is made from, kept together so it can be built again
+// when the git segment arrives while a line is being edited
+typedef struct {
+	char path[PATH_MAX];
+	int status;
+	char text[PATH_MAX*2+64];
+} Prompt;
+
+Prompt main_prompt={0};
+
+void prompt_build(void) {
+	Prompt* p=&main_prompt;
+	int len=snprintf(p->text,sizeof(p->text),"%s %s ",pname,p->path);
+	char* git=git_prompt_text();
+	if(git && *git && len>=0 && (size_t)len<sizeof(p->text)) len+=snprintf(p->text+len,sizeof(p->text)-len,"(%s) ",git);
+	if(p->status>0 && len>=0 && (size_t)len<sizeof(p->text)) len+=snprintf(p->text+len,sizeof(p->text)-len,"[%d] ",p->status);
+	if(len>=0 && (size_t)len<sizeof(p->text)) snprintf(p->text+len,sizeof(p->text)-len,"> ");
+}
+
+typedef enum {
+	WAIT_INPUT,
+	WAIT_JOBS,
+	WAIT_PROMPT,
+	WAIT_COMMANDS,
+} WaitResult;
+
+// Blocks until keys_fd is readable, reaping children whenever SIGCHLD arrives meanwhile,
+// and also wakes up when a job has something to report, the git segment changed or the
+// command index is complete
+WaitResult wait_input(void) {
+	if(event_fd<0) return WAIT_INPUT;
+	struct epoll_event events[4];
+	while(1) {
+		int count=epoll_wait(event_fd,events,4,-1);
+		if(count<0) {
+			if(errno==EINTR) continue;
+			return WAIT_INPUT;
+		}
+		bool input=false;
+		bool changed=false;
+		bool reprompt=false;
+		bool indexed=false;
+		for(int i=0; i<count; i++) {
+			if(events[i].data.fd==sigchld_fd) changed=reap_jobs();
+			else if(events[i].data.fd==cmd_index.fd) {
+				cmd_index_read();
+				indexed=cmd_index.fd<0;
+			}
+			else if(events[i].data.fd==git_prompt.fd) reprompt|=git_prompt_read();
+			else input=true;
+		}
+		if(input) return WAIT_INPUT;
+		if(changed) return WAIT_JOBS;
+		if(reprompt) return WAIT_PROMPT;
+		if(indexed) return WAIT_COMMANDS;
+	}
+}
+
+// Gives the terminal back to the shell after a job stopped, keeping the job's modes for fg
+void stop_job(Job* job) {
+	tcsetpgrp(STDIN_FILENO,getpgid(getpid()));
+	job->has_tmodes=tcgetattr(STDIN_FILENO,&job->tmodes)==0;
+	tcsetattr(STDIN_FILENO,TCSADRAIN,&initial_state);
+	fprintf(stderr,"\n");
+	print_job(job);
+	job->notify=false;
+}
+
+// Blocks until job finished or stopped, or C-c gave up on waiting for it
+void wait_job_state(Job* job) {
+	int status;
+	while(job->state==JOB_RUNNING && !sigint_caught) {
+		pid_t pid=waitpid(-job->pgid,&status,WUNTRACED);
+		if(pid>0) {
+			update_job(pid,status);
+		} else if(errno!=EINTR) {
+			job->state=JOB_DONE;
+			break;
+		}
+	}
+}
+
+// Continues job in the foreground and waits until it finishes or stops again
+int foreground_job(Job* job) {
+	if(job->has_tmodes) tcsetattr(STDIN_FILENO,TCSADRAIN,&job->tmodes);
+	tcsetpgrp(STDIN_FILENO,job->pgid);
+	if(job->state==JOB_STOPPED) kill(-job->pgid,SIGCONT);
+	for(size_t i=0; i<job->nprocs; i++) job->procs[i].stopped=false;
+	update_job_state(job);
+	wait_job_state(job);
+	if(job->state==JOB_STOPPED) {
+		stop_job(job);
+		return 128+SIGTSTP;
+	}
+	tcsetpgrp(STDIN_FILENO,getpgid(getpid()));
+	int code=job_exit_code(job);
+	remove_job(job);
+	return code;
+}
+
+unsigned char inbuf[4096];
+size_t inlen=0;
+size_t inpos=0;
+
+// Keys are read in blocks so pasted or typed ahead text is handled in one go
+unsigned char read_key(void) {
+	while(inpos>=inlen) {
+		ssize_t count=read(keys_fd,inbuf,sizeof(inbuf));
+		if(count<0 && errno==EINTR) continue;
+		if(count<=0) return 0;
+		inlen=count;
+		inpos=0;
+	}
+	return inbuf[inpos++];
+}
+
+bool input_pending(void) {
+	return inpos<inlen;
+}
+
+char* highlight(Text text);
+bool highlight_ends_command(size_t i);
+
+// Reads a bracketed paste up to its end marker and inserts it at once. The pasted lines
+// are joined, a line break that ends a command becomes ';' and one inside a string or
+// before a command has come (after |, then or do) a space. Comments would swallow the
+// lines after them so they are dropped, other control characters become spaces
+size_t paste(GapBuf* line,size_t idx) {
+	static StrBuf pasted={0};
+	static char endmark[]="\x1b[201~";
+	size_t marklen=strlen(endmark);
+	pasted.len=0;
+	while(pasted.len<marklen || memcmp(pasted.items+pasted.len-marklen,endmark,marklen)!=0) {
+		unsigned char ch=read_key();
+		if(ch==0) break;
+		da_append(&pasted,ch);
+	}
+	if(pasted.len>=marklen && memcmp(pasted.items+pasted.len-marklen,endmark,marklen)==0) pasted.len-=marklen;
+	while(pasted.len && (pasted.items[pasted.len-1]=='\n' || pasted.items[pasted.len-1]=='\r')) pasted.len--;
+	for(size_t i=0; i<pasted.len; i++) {
+		char ch=pasted.items[i];
+		if(ch=='\r' && i+1<pasted.len && pasted.items[i+1]=='\n') pasted.items[i]=' ';
+		else if(ch=='\r') pasted.items[i]='\n';
+		else if(ch!='\n' && ((unsigned char)ch<' ' || ch==127)) pasted.items[i]=' ';
+	}
+	gap_insert(line,idx,pasted.items,pasted.len);
+	size_t end=idx+pasted.len;
+	for(size_t i=idx; i<end; i++) {
+		if(gap_at(line,i)!='\n') continue;
+		char* styles=highlight(gap_text(line));
+		size_t from=i;
+		while(from>idx && styles[from-1]==STYLE_COMMENT) from--;
+		while(from>idx && gap_at(line,from-1)==' ') from--;
+		if(from<i) {
+			gap_delete(line,from,i);
+			end-=i-from;
+			i=from;
+			highlight(gap_text(line));
+		}
+		char* sep=highlight_ends_command(i)?"; ":" ";
+		size_t to=i+1;
+		while(to<end && gap_at(line,to)==' ') to++;
+		gap_delete(line,i,to);
+		gap_insert(line,i,sep,strlen(sep));
+		end+=strlen(sep)-(to-i);
+		i+=strlen(sep)-1;
+	}
+	return end;
+}
+
+// Incremental C-r/C-s search, puts the selected entry in line and returns the key
+// that ended the search (0 when it was cancelled)
+unsigned char history_search_mode(Display* d,StrArr history,GapBuf* line,bool reverse) {
+	static StrBuf query={0};
+	static StrBuf original={0};
+	char prompt[128];
+	size_t results[SEARCH_MAX_RESULTS];
+	size_t nresults=0;
+	size_t cur=0;
+	query.len=0;
+	original.len=0;
+	gap_copy(line,0,gap_len(line),&original);
+	while(1) {
+		char* match=nresults?history.items[results[cur]]:"";
+		snprintf(prompt,sizeof(prompt),"(%s%s-i-search)`%.*s': ",nresults || query.len==0?"":"failed ",reverse?"reverse":"fwd",(int)query.len,query.items);
+		display_reprompt(d,prompt);
+		display_refresh(d,str_text(match,strlen(match)),NULL,0);
+		unsigned char ch=read_key();
+		switch(ch) {
+			case 'R'-'@':
+				reverse=true;
+				if(cur+1<nresults) cur++;
+				continue;
+			case 'S'-'@':
+				reverse=false;
+				if(cur>0) cur--;
+				continue;
+			case 'G'-'@':
+				gap_set(line,original.items,original.len);
+				return 0;
+			case 'H'-'@':
+			case 127:
+				if(query.len) query.len--;
+				break;
+			default:
+				if(ch<' ') {
+					if(nresults) gap_set(line,match,strlen(match));
+					return ch;
+				}
+				da_append(&query,ch);
+		}
+		da_append(&query,'\0');
+		query.len--;
+		nresults=search_history(history,query.items,query.len,results);
+		cur=0;
+	}
+}
+
+void complete(Display* d,GapBuf* line,size_t* idx,bool list);
+
+// The rest of the most recent history entry the line is the start of, as long as the
+// cursor is at the end of the line
+char* suggestion(GapBuf* line,size_t idx,StrArr history) {
+	static StrBuf typed={0};
+	if(idx==0 || idx<gap_len(line)) return NULL;
+	typed.len=0;
+	gap_copy(line,0,idx,&typed);
+	char* entry=hist_prefix_find(history.items,typed.items,typed.len);
+	return entry?entry+typed.len:NULL;
+}
+
+// Draws the highlighted line followed by the suggestion in faint ghost text
+void refresh_line(Display* d,GapBuf* line,size_t idx,char* suggested) {
+	static StrBuf text={0};
+	static StrBuf styles={0};
+	char* highlighted=highlight(gap_text(line));
+	if(suggested==NULL) {
+		display_refresh(d,gap_text(line),highlighted,idx);
+		return;
+	}
+	text.len=0;
+	styles.len=0;
+	gap_copy(line,0,gap_len(line),&text);
+	for(size_t i=0; i<gap_len(line); i++) da_append(&styles,highlighted[i]);
+	for(char* ch=suggested; *ch; ch++) {
+		da_append(&text,*ch);
+		da_append(&styles,STYLE_SUGGESTION);
+	}
+	display_refresh(d,str_text(text.items,text.len),styles.items,idx);
+}
+
+// Reads a line into command, false means it was given up on with C-c
+bool readline(char* prompt,StrBuf* command,StrArr history) {
+	static StrBuf killring={0};
+	static Display display={0};
+	static GapBuf line={0};
+	// what was typed before going through the history, only entries starting with it
+	// come up then
+	static StrBuf typed={0};
+	Display* d=&display;
 	size_t idx=0;
-	size_t curlen=0;
 	size_t hist_idx=history.len;
 	bool edited=false;
+	typed.len=0;
 	getsize(0);
-	size_t prompt_len=strlen(prompt)%term_width;
 	tcgetattr(keys_fd,&initial_state);
 	Termios raw=initial_state;
 	raw.c_lflag&=~(ISIG|ICANON|ECHO);
+	raw.c_iflag&=~IXON;
 	raw.c_cc[VMIN]=1;
 	raw.c_cc[VTIME]=0;
-	printf("%s",prompt);
-	command->len=0;
-	tcsetattr(keys_fd,TCSAFLUSH,&raw);
+	fflush(stdout);
+	gap_set(&line,"",0);
+	display_append(d,"\x1b[?2004h",8);
+	display_prompt(d,prompt);
+	tcsetattr(keys_fd,TCSANOW,&raw);
+	cmd_index_refresh();
 	unsigned char ch=0;
+	bool tabbed=false;
+	bool cancelled=false;
+	char* suggested=NULL;
 	while(ch!='\n') {
-		ch=getchar();
+		if(!input_pending()) {
+			suggested=suggestion(&line,idx,history);
+			refresh_line(d,&line,idx,suggested);
+			WaitResult woke=wait_input();
+			if(woke==WAIT_JOBS) {
+				// a job finished meanwhile, report it above a fresh copy of the line
+				display_finish(d);
+				report_jobs(false);
+				display_prompt(d,prompt);
+				continue;
+			}
+			if(woke==WAIT_PROMPT && prompt==main_prompt.text) {
+				prompt_build();
+				display_reprompt(d,prompt);
+			}
+			// unknown commands can only be told apart once the index is complete
+			if(woke!=WAIT_INPUT) continue;
+		}
+		ch=read_key();
 got_char:
 		if(!ch) break;
+		bool second_tab=tabbed;
+		tabbed=ch=='\t';
 		switch(ch) {
+			case '\t':
+				complete(d,&line,&idx,second_tab);
+				edited=true;
+				break;
 			case '\x1b':
 parse_esc:
-				ch=getchar();
+				ch=read_key();
+esc_final:
 				switch(ch) {
 					case '[':
 						goto parse_esc;
 					case 'A':
 prev_hist:
-						if(hist_idx>0) {
-							if(curlen+prompt_len>term_width) {
-								printf("\x1b[%zuB",(curlen-idx+prompt_len)/term_width);
-								for(size_t i=0; i<curlen+prompt_len; i+=term_width) printf("\r\x1b[K\x1b[A");
-							}
-							if(edited) {
-								// TODO search backwards through history for a match of current command
-							}
-							if(history.items[--hist_idx]) {
-								command->len=0;
-								size_t cmdlen=strlen(history.items[hist_idx]);
-								for(size_t i=0; i<cmdlen; i++) {
-									da_append(command,history.items[hist_idx][i]);
-								}
-								curlen=command->len;
-								idx=curlen;
-							}
+						if(edited) {
+							typed.len=0;
+							gap_copy(&line,0,gap_len(&line),&typed);
+						}
+						for(size_t i=hist_idx; i>0; i--) {
+							if(strncmp(history.items[i-1],typed.items,typed.len)!=0) continue;
+							hist_idx=i-1;
+							gap_set(&line,history.items[hist_idx],strlen(history.items[hist_idx]));
+							idx=gap_len(&line);
 							edited=false;
-							printf("\r\x1b[K%s%.*s",prompt,(int)curlen,command->items);
+							break;
 						}
 						break;
 					case 'B':
 next_hist:
+						if(edited) {
+							typed.len=0;
+							gap_copy(&line,0,gap_len(&line),&typed);
+						}
 						if(hist_idx<history.len) {
-							if(curlen+prompt_len>term_width) {
-								printf("\x1b[%zuB",(curlen-idx+prompt_len)/term_width);
-								for(size_t i=0; i<curlen+prompt_len; i+=term_width) printf("\r\x1b[K\x1b[A");
-							}
-							if(edited) {
-								// TODO search backwards through history for a match of current command
-							}
-							if(++hist_idx<history.len && history.items[hist_idx]) {
-								command->len=0;
-								size_t cmdlen=strlen(history.items[hist_idx]);
-								for(size_t i=0; i<cmdlen; i++) {
-									da_append(command,history.items[hist_idx][i]);
-								}
-								curlen=command->len;
-								idx=curlen;
-							} else {
-								curlen=0;
-								idx=0;
-								command->len=0;
-							}
+							hist_idx++;
+							while(hist_idx<history.len && strncmp(history.items[hist_idx],typed.items,typed.len)!=0) hist_idx++;
+							if(hist_idx<history.len) gap_set(&line,history.items[hist_idx],strlen(history.items[hist_idx]));
+							else gap_set(&line,typed.items,typed.len);
+							idx=gap_len(&line);
 							edited=false;
-							printf("\r\x1b[K%s%.*s",prompt,(int)curlen,command->items);
 						}
 						break;
 					case 'C':
 move_right:
-						if(idx<curlen) {
-							printf("%c",command->items[idx]);
+						if(idx==gap_len(&line) && (suggested=suggestion(&line,idx,history))) goto accept;
+						if(idx<gap_len(&line)) {
 							idx++;
+							while(idx<gap_len(&line) && is_utf8_cont(gap_at(&line,idx))) idx++;
 						}
 						break;
 					case 'D':
 move_left:
-						if(idx>0) {
-							printf("\b");
-							idx--;
-						}
-						break;
-					case '3': // Delete
-						ch=getchar();
-						if(ch!='~') goto got_char;
-delete_char:
-						if(idx<curlen) {
-							for(size_t i=idx; i+1<curlen; i++) {
-								command->items[i]=command->items[i+1];
-							}
-							curlen--;
-							command->len=curlen;
-							printf("\x1b""7%.*s \x1b""8",(int)(curlen-idx),command->items+idx);
-						}
+						while(idx>0 && is_utf8_cont(gap_at(&line,--idx)));
 						break;
+					case 'H':
+						goto line_start;
+					case 'F':
+						goto line_end;
 					default:
-						goto got_char;
+						if(!isdigit(ch)) goto got_char;
+						int param=0;
+						while(isdigit(ch)) {
+							param=param*10+ch-'0';
+							ch=read_key();
+						}
+						// modifiers as in \x1b[1;5C are ignored
+						while(ch==';' || isdigit(ch)) ch=read_key();
+						if(ch!='~') {
+							if(isalpha(ch)) goto esc_final;
+							goto got_char;
+						}
+						switch(param) {
+							case 1:
+							case 7:
+								goto line_start;
+							case 4:
+							case 8:
+								goto line_end;
+							case 3:
+								goto delete_char;
+							case 200:
+								idx=paste(&line,idx);
+								edited=true;
+								break;
+						}
 				}
 				break;
 			case 'A'-'@':
-				if(idx+prompt_len>term_width) printf("\x1b[%zuA",(idx+prompt_len)/term_width);
-				printf("\r\x1b[%zuC",prompt_len);
+line_start:
 				idx=0;
 				break;
 			case 'E'-'@':
-				if(curlen+prompt_len>term_width) printf("\x1b[%zuB",(curlen-idx+prompt_len)/term_width);
-				printf("\r\x1b[%zuC",(curlen+prompt_len)%term_width);
-				idx=curlen;
+				if(idx==gap_len(&line) && (suggested=suggestion(&line,idx,history))) goto accept;
+line_end:
+				idx=gap_len(&line);
 				break;
 			case 'D'-'@':
-				if(curlen>0) goto delete_char;
-				command->len=0;
+				if(gap_len(&line)>0) goto delete_char;
 				// FIXME very hacky way of quitting :)
-				for(size_t i=0; i<4; i++) {
-					da_append(command,"exit"[i]);
-				}
-				curlen=4;
+				gap_set(&line,"exit",4);
+				idx=gap_len(&line);
 				ch='\n';
 				break;
 			case 'C'-'@':
-				printf("\r%*c\r%s",(int)(prompt_len+curlen),' ',prompt);
-				curlen=0;
+				display_refresh(d,gap_text(&line),highlight(gap_text(&line)),gap_len(&line));
+				display_append(d,"^C",2);
+				gap_set(&line,"",0);
+				cancelled=true;
+				ch='\n';
 				break;
 			case 'F'-'@':
 				goto move_right;
@@ -485,283 +2926,2006 @@ delete_char:
 			case 'H'-'@':
 			case 127: // Backspace
 				if(idx>0) {
-					for(size_t i=idx-1; i+1<curlen; i++) {
-						command->items[i]=command->items[i+1];
-					}
-					curlen--;
-					command->len--;
-					printf("\x1b[D\x1b""7%.*s \x1b""8",(int)(curlen-idx+1),command->items+idx-1);
-					idx--;
+					size_t end=idx;
+					while(idx>0 && is_utf8_cont(gap_at(&line,--idx)));
+					gap_delete(&line,idx,end);
+					edited=true;
 				}
 				break;
 			case 'K'-'@':
-				if(idx>=curlen) break;
+				if(idx>=gap_len(&line)) break;
 				killring.len=0;
-				for(size_t i=idx; i<curlen; i++) {
-					da_append(&killring,command->items[i]);
-					printf(" ");
-				}
-				for(size_t i=idx; i<curlen; i++) printf("\b");
-				curlen=idx;
-				command->len=idx;
+				gap_copy(&line,idx,gap_len(&line),&killring);
+				gap_delete(&line,idx,gap_len(&line));
+				edited=true;
 				break;
 			case 'L'-'@':
-				printf("\x1b[H\x1b[2J%s%.*s",prompt,(int)curlen,command->items);
-				for(size_t i=curlen; i>idx; i--) {
-					printf("\b");
-				}
+				display_append(d,"\x1b[H\x1b[2J",7);
+				d->cursor=0;
+				display_prompt(d,prompt);
 				break;
 			case 'N'-'@':
 				goto next_hist;
-				break;
 			case 'P'-'@':
 				goto prev_hist;
-				break;
+			case 'R'-'@':
+			case 'S'-'@':
+				ch=history_search_mode(d,history,&line,ch=='R'-'@');
+				idx=gap_len(&line);
+				hist_idx=history.len;
+				typed.len=0;
+				display_reprompt(d,prompt);
+				if(ch==0) break;
+				goto got_char;
 			case 'U'-'@':
 				if(idx==0) break;
 				killring.len=0;
-				for(size_t i=0; i<idx; i++) {
-					da_append(&killring,command->items[i]);
-					printf("\b");
-				}
-				printf("%.*s",(int)(curlen-idx),command->items+idx);
-				for(size_t i=0; i<idx; i++) {
-					command->items[i]=command->items[i+idx];
-					printf(" ");
-				}
-				for(size_t i=0; i<curlen; i++) printf("\b");
-				fflush(stdout);
-				curlen-=idx;
-				command->len=curlen;
+				gap_copy(&line,0,idx,&killring);
+				gap_delete(&line,0,idx);
 				idx=0;
+				edited=true;
 				break;
 			case 'Y'-'@':
-				size_t klen=killring.len;
-				if(klen==0) break;
-				printf("%.*s%s",(int)klen,killring.items,command->items+idx);
-				for(size_t i=idx; i<curlen; i++) {
-					da_append(&killring,command->items[i]);
-					printf("\b");
-				}
-				command->len=idx;
-				for(size_t i=0; i<killring.len; i++) {
-					da_append(command,killring.items[i]);
-				}
-				fflush(stdout);
-				curlen+=klen;
-				killring.len=klen;
-				idx+=klen;
+				if(killring.len==0) break;
+				gap_insert(&line,idx,killring.items,killring.len);
+				idx+=killring.len;
+				edited=true;
 				break;
 			default:
 				if(ch<' ') continue;
-				da_append(command,ch);
-				if(idx<curlen) {
-					printf(" %.*s\b",(int)(curlen-idx),command->items+idx);
-					for(size_t i=curlen; i>idx; i--) {
-						command->items[i]=command->items[i-1];
-						printf("\b");
-					}
-					command->items[idx]=ch;
-				}
-				curlen++;
-				printf("%c",ch);
-				fflush(stdout);
+				gap_insert(&line,idx,(char*)&ch,1);
 				edited=true;
 				idx++;
 		}
+		continue;
+accept:
+		gap_insert(&line,idx,suggested,strlen(suggested));
+		idx=gap_len(&line);
+		edited=true;
+		continue;
+delete_char:
+		if(idx<gap_len(&line)) {
+			size_t end=idx+1;
+			while(end<gap_len(&line) && is_utf8_cont(gap_at(&line,end))) end++;
+			gap_delete(&line,idx,end);
+			edited=true;
+		}
+	}
+	if(!cancelled) display_refresh(d,gap_text(&line),highlight(gap_text(&line)),gap_len(&line));
+	display_append(d,"\x1b[?2004l",8);
+	display_finish(d);
+	tcsetattr(keys_fd,TCSANOW,&initial_state);
+	command->len=0;
+	gap_copy(&line,0,gap_len(&line),command);
+	da_append(command,'\0');
+	return !cancelled;
+}
+
+int histfd=-1;
+off_t histoff=0;
+char histfilename[PATH_MAX];
+
+bool remember_history(char* command,size_t len,StrArr* history) {
+	if(len==0) return false;
+	if(history->len>0 && strncmp(command,history->items[history->len-1],len)==0 && history->items[history->len-1][len]=='\0') return false;
+	char* copy;
+	if(histidx+len+1<=HIST_BUF_CAP) {
+		copy=histbuf+histidx;
+		histidx+=len+1;
+	} else {
+		copy=malloc(len+1);
+	}
+	memcpy(copy,command,len);
+	copy[len]='\0';
+	hist_index_add(copy,len,history->len);
+	hist_prefix_add(history->items,copy,len,history->len);
+	da_append(history,copy);
+	return true;
+}
+
+// Drops every entry along with the search index and suggestion tree built over them
+void forget_history(StrArr* history) {
+	for(size_t i=0; i<history->len; i++) {
+		char* entry=history->items[i];
+		if(entry<histbuf || entry>=histbuf+HIST_BUF_CAP) free(entry);
+	}
+	history->len=0;
+	histidx=0;
+	for(size_t i=0; i<hist_index.cap; i++) free(hist_index.postings[i].items);
+	free(hist_index.keys);
+	free(hist_index.postings);
+	hist_index=(HistIndex) {0};
+	hist_prefix.len=0;
+}
+
+// Locks the history file, following it if another session replaced it while compacting.
+// The replacement holds everything that is worth keeping, so the entries read from the
+// old file are dropped to be read again from the new one
+bool history_lock(StrArr* history) {
+	if(histfd<0) return false;
+	while(1) {
+		if(flock(histfd,LOCK_EX)<0) return false;
+		struct stat fdst,pathst;
+		if(fstat(histfd,&fdst)<0) break;
+		if(stat(histfilename,&pathst)==0 && pathst.st_ino==fdst.st_ino && pathst.st_dev==fdst.st_dev) return true;
+		int newfd=open(histfilename,O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC,0600);
+		if(newfd<0) break;
+		close(histfd);
+		histfd=newfd;
+		histoff=0;
+		if(history) forget_history(history);
+	}
+	flock(histfd,LOCK_UN);
+	return false;
+}
+
+// Picks up the lines other sessions appended since we last looked, the lock must be held
+void history_read_new(StrArr* history) {
+	struct stat st;
+	if(fstat(histfd,&st)<0) return;
+	if(st.st_size<=histoff) {
+		histoff=st.st_size;
+		return;
+	}
+	size_t size=st.st_size-histoff;
+	char* data=malloc(size);
+	ssize_t count=pread(histfd,data,size,histoff);
+	if(count>0) {
+		for(size_t start=0; start<(size_t)count;) {
+			char* endl=memchr(data+start,'\n',count-start);
+			if(endl==NULL) break;
+			char* line=data+start;
+			size_t len=endl-line;
+			start+=len+1;
+			histoff+=len+1;
+			while(len && isspace(line[len-1])) len--;
+			while(len && isspace(*line)) {
+				line++;
+				len--;
+			}
+			remember_history(line,len,history);
+		}
+	}
+	free(data);
+}
+
+void compact_history(bool background);
+
+// Appends a single entry with one write so concurrent sessions never interleave,
+// lines written by other sessions in the meantime are merged in first
+void add_history(char* command,StrArr* history) {
+	size_t len=strlen(command);
+	if(len==0) return;
+	bool locked=strcmp(command,"exit")!=0 && history_lock(history);
+	if(locked) history_read_new(history);
+	if(remember_history(command,len,history) && locked) {
+		struct iovec iov[2]={{command,len},{"\n",1}};
+		ssize_t count=writev(histfd,iov,2);
+		if(count>0) histoff+=count;
+	}
+	if(locked) flock(histfd,LOCK_UN);
+}
+
+void populate_history(StrArr* history,char* homedir) {
+	snprintf(histfilename,PATH_MAX,"%s/.abysh_history",homedir);
+	histfd=open(histfilename,O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC,0600);
+	if(!history_lock(history)) return;
+	history_read_new(history);
+	flock(histfd,LOCK_UN);
+	if(histoff>HIST_BUF_CAP) compact_history(true);
+}
+
+// Rewrites the history file without duplicates, keeping the most recent occurrence
+// of each line, in a detached grandchild when background is set
+void compact_history(bool background) {
+	if(histfd<0) return;
+	if(background) {
+		pid_t pid=fork();
+		if(pid<0) return;
+		if(pid>0) {
+			waitpid(pid,NULL,0);
+			return;
+		}
+		setsid();
+		if(fork()!=0) _exit(0);
+		// a lock on the inherited descriptor would be the shell's own lock as well, the
+		// shell could then append while the file is rewritten
+		close(histfd);
+		histfd=open(histfilename,O_RDWR|O_APPEND|O_CLOEXEC);
+		if(histfd<0) _exit(0);
+	}
+	if(history_lock(NULL)) {
+		struct stat st;
+		fstat(histfd,&st);
+		char* data=malloc(st.st_size+1);
+		ssize_t size=pread(histfd,data,st.st_size,0);
+		// rewriting from a short read would lose the rest of the history
+		bool complete=size==st.st_size;
+		if(!complete) size=0;
+		data[size]='\0';
+		StrArr lines={0};
+		for(char* line=data; line<data+size;) {
+			char* endl=memchr(line,'\n',data+size-line);
+			if(endl==NULL) endl=data+size;
+			*endl='\0';
+			da_append(&lines,line);
+			line=endl+1;
+		}
+		size_t cap=DA_INIT_CAP;
+		while(cap<lines.len*2) cap*=2;
+		char** seen=calloc(cap,sizeof(char*));
+		bool* keep=calloc(lines.len+1,sizeof(bool));
+		for(size_t i=lines.len; i>0; i--) {
+			char* line=lines.items[i-1];
+			if(*line=='\0') continue;
+			size_t j=hash_str(line,strlen(line))&(cap-1);
+			while(seen[j] && strcmp(seen[j],line)!=0) j=(j+1)&(cap-1);
+			if(seen[j]) continue;
+			seen[j]=line;
+			keep[i-1]=true;
+		}
+		char tmpname[PATH_MAX+16];
+		snprintf(tmpname,sizeof(tmpname),"%s.%d",histfilename,getpid());
+		// private like the history file it replaces
+		int tmpfd=complete?open(tmpname,O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC,0600):-1;
+		FILE* out=tmpfd<0?NULL:fdopen(tmpfd,"w");
+		if(out==NULL && tmpfd>=0) {
+			close(tmpfd);
+			unlink(tmpname);
+		}
+		if(out) {
+			for(size_t i=0; i<lines.len; i++) {
+				if(keep[i]) fprintf(out,"%s\n",lines.items[i]);
+			}
+			// a failed write must not replace the history with whatever made it out
+			bool written=!ferror(out);
+			if(fclose(out)==0 && written) rename(tmpname,histfilename);
+			else unlink(tmpname);
+		}
+		flock(histfd,LOCK_UN);
+		free(seen);
+		free(keep);
+		free(lines.items);
+		free(data);
+	}
+	if(background) _exit(0);
+}
+
+void version(char* program,FILE* fd) {
+	fprintf(fd,"%s (Abyss Shell) version %s\n",program,VERSION);
+}
+
+void help(char* program,FILE* fd) {
+	version(program,fd);
+	fprintf(fd,"\n");
+	fprintf(fd,"List of builtin commands:\n");
+	fprintf(fd,"    exit           Close the shell\n");
+	fprintf(fd,"    cd directory   Change CWD to directory\n");
+	fprintf(fd,"    export [name[=value]...]\n");
+	fprintf(fd,"                   Pass the variables to the commands the shell runs, or list them\n");
+	fprintf(fd,"    exec command [arg...]\n");
+	fprintf(fd,"                   Replace the shell with command\n");
+	fprintf(fd,"    hash [-r] [name...]\n");
+	fprintf(fd,"                   List remembered command locations, forget them all (-r)\n");
+	fprintf(fd,"                   or look up and remember the given names\n");
+	fprintf(fd,"    history [-r|-k]\n");
+	fprintf(fd,"                   List the history, read the lines other sessions added (-r)\n");
+	fprintf(fd,"                   or remove duplicates from the history file in the background (-k)\n");
+	fprintf(fd,"    version        Prints the version of the shell in a single line\n");
+	fprintf(fd,"    echo [-neE] [arg...]\n");
+	fprintf(fd,"                   Print the arguments separated by spaces\n");
+	fprintf(fd,"    printf format [arg...]\n");
+	fprintf(fd,"                   Print the arguments according to format\n");
+	fprintf(fd,"    test expr, [ expr ]\n");
+	fprintf(fd,"                   Evaluate a conditional expression\n");
+	fprintf(fd,"    true, false    Return a successful or unsuccessful status\n");
+	fprintf(fd,"    pwd            Print the current working directory\n");
+	fprintf(fd,"    jobs           List the background and stopped jobs\n");
+	fprintf(fd,"    fg [%%n]        Continue a job in the foreground\n");
+	fprintf(fd,"    bg [%%n]        Continue a stopped job in the background\n");
+	fprintf(fd,"    wait [%%n...]   Wait for the given jobs (or all of them) to finish\n");
+	fprintf(fd,"    parallel [-j N] [-g] command [arg...] [::: item...]\n");
+	fprintf(fd,"                   Run command for every item (or line of input) with at most N\n");
+	fprintf(fd,"                   at a time, {} in the arguments is replaced by the item and -g\n");
+	fprintf(fd,"                   prints the output of each job in one piece\n");
+	fprintf(fd,"    help           Print this help\n");
+	fprintf(fd,"\n");
+	fprintf(fd,"Prefix a pipeline with `time` to report the time and resources used by each\n");
+	fprintf(fd,"command, set ABYSH_REPORTTIME to a number of seconds to get the same report\n");
+	fprintf(fd,"for every pipeline that runs at least that long.\n");
+	fprintf(fd,"\n");
+	fprintf(fd,"PIPESTATUS holds the exit status of every command of the last pipeline, and\n");
+	fprintf(fd,"ABYSH_PIPESIZE (in bytes, K or M) sets the capacity of the pipes between them.\n");
+	fprintf(fd,"\n");
+	fprintf(fd,"Commands can be joined with ;, && and ||, and grouped with\n");
+	fprintf(fd,"    if list; then list; [elif list; then list;]... [else list;] fi\n");
+	fprintf(fd,"    while list; do list; done\n");
+	fprintf(fd,"    for name in word...; do list; done\n");
+	fprintf(fd,"$(list) and `list` are replaced by what the commands print.\n");
+	fprintf(fd,"\n");
+	fprintf(fd,"Run `%s script` or `%s -c commands` to run commands without a prompt,\n",program,program);
+	fprintf(fd,"commands piped into the shell run as soon as each one is complete.\n");
+}
+
+void close_redirects(Cmd* cmd) {
+	for(size_t i=0; i<cmd->redirects.len; i++) {
+		Redirect* redirect=&cmd->redirects.items[i];
+		if(redirect->kind==REDIR_DUP || redirect->src<0) continue;
+		close(redirect->src);
+		redirect->src=-1;
+	}
+}
+
+// Opens the files cmd redirects to in the shell, so the child (or a builtin) only has to
+// dup2 them into place. They are moved above the low descriptors a redirection may target
+bool open_redirects(Cmd* cmd) {
+	for(size_t i=0; i<cmd->redirects.len; i++) {
+		Redirect* redirect=&cmd->redirects.items[i];
+		int flags=O_RDONLY;
+		switch(redirect->kind) {
+			case REDIR_DUP:
+				continue;
+			case REDIR_READ:
+				break;
+			case REDIR_WRITE:
+				flags=O_WRONLY|O_CREAT|O_TRUNC;
+				break;
+			case REDIR_APPEND:
+				flags=O_WRONLY|O_CREAT|O_APPEND;
+				break;
+		}
+		if(redirect->path==NULL) {
+			fprintf(stderr,"%s: ambiguous redirect\n",pname);
+			close_redirects(cmd);
+			return false;
+		}
+		int fd=open(redirect->path,flags|O_CLOEXEC,0666);
+		if(fd<0) {
+			fprintf(stderr,"%s: %s: %s\n",pname,redirect->path,strerror(errno));
+			close_redirects(cmd);
+			return false;
+		}
+		redirect->src=fcntl(fd,F_DUPFD_CLOEXEC,10);
+		close(fd);
+	}
+	return true;
+}
+
+// Puts every redirection in place in the current process, with save set the descriptors
+// they replace are kept for restore_redirects
+bool apply_redirects(Cmd* cmd,bool save) {
+	for(size_t i=0; i<cmd->redirects.len; i++) {
+		Redirect* redirect=&cmd->redirects.items[i];
+		if(save) redirect->saved=fcntl(redirect->fd,F_DUPFD_CLOEXEC,10);
+		if(dup2(redirect->src,redirect->fd)<0) {
+			fprintf(stderr,"%s: %d: %s\n",pname,redirect->src,strerror(errno));
+			if(redirect->saved>=0) close(redirect->saved);
+			redirect->saved=-1;
+			return false;
+		}
+		redirect->applied=save;
+	}
+	return true;
+}
+
+void restore_redirects(Cmd* cmd) {
+	for(size_t i=cmd->redirects.len; i>0; i--) {
+		Redirect* redirect=&cmd->redirects.items[i-1];
+		if(!redirect->applied) continue;
+		if(redirect->saved>=0) {
+			dup2(redirect->saved,redirect->fd);
+			close(redirect->saved);
+		} else {
+			close(redirect->fd);
+		}
+		redirect->saved=-1;
+		redirect->applied=false;
+	}
+}
+
+// Builds the environment of a child: the exported variables with the temporary
+// ones layered on top and `_` set to the executed path
+char** stage_env(StrArr tmpvars,char* path) {
+	static StrArr envp={0};
+	static char underscore[PATH_MAX+2];
+	char** base=exported_env();
+	size_t len=vars.envp.len-2;
+	snprintf(underscore,sizeof(underscore),"_=%s",path);
+	if(tmpvars.len==0) {
+		base[len]=underscore;
+		return base;
+	}
+	envp.len=0;
+	for(size_t i=0; i<len; i++) da_append(&envp,base[i]);
+	for(size_t i=0; i<tmpvars.len; i++) {
+		char* eq=strchr(tmpvars.items[i],'=');
+		if(eq==NULL || (eq-tmpvars.items[i]==1 && tmpvars.items[i][0]=='_')) continue;
+		Var* var=find_var(tmpvars.items[i],eq-tmpvars.items[i]);
+		char* entry=eq[1]!='\0'?tmpvars.items[i]:NULL;
+		if(var && var->exported) envp.items[var->envidx]=entry;
+		else if(entry) da_append(&envp,entry);
+	}
+	// temporary variables assigned an empty value are left out
+	size_t kept=0;
+	for(size_t i=0; i<envp.len; i++) {
+		if(envp.items[i]) envp.items[kept++]=envp.items[i];
+	}
+	envp.len=kept;
+	da_append(&envp,underscore);
+	da_append(&envp,NULL);
+	return envp.items;
+}
+
+// Whether the arguments and environment of cmd fit what execve takes, pathbuf has to be
+// resolved already. Checked up front as E2BIG would read like any other failure to start
+bool args_fit(Cmd* cmd,bool report) {
+	static long limit=0;
+	static size_t strmax=0;
+	if(limit==0) {
+		limit=sysconf(_SC_ARG_MAX);
+		// Linux also caps every single string at 32 pages
+		strmax=32*(size_t)sysconf(_SC_PAGESIZE);
+	}
+	size_t total=0;
+	size_t longest=0;
+	char** lists[]={cmd->current.items,stage_env(cmd->tmpvars,pathbuf)};
+	for(size_t i=0; i<2; i++) {
+		for(char** str=lists[i]; *str; str++) {
+			size_t len=strlen(*str)+1;
+			total+=len+sizeof(char*);
+			if(len>longest) longest=len;
+		}
+	}
+	if((limit<0 || total<=(size_t)limit) && longest<=strmax) return true;
+	errno=E2BIG;
+	if(!report) return false;
+	if(longest>strmax) fprintf(stderr,"%s: %s: argument list too long, one argument takes %zu bytes and at most %zu fit\n",pname,cmd->current.items[0],longest,strmax);
+	else fprintf(stderr,"%s: %s: argument list too long, it takes %zu bytes with the environment and at most %ld fit\n",pname,cmd->current.items[0],total,limit);
+	return false;
+}
+
+// Replaces the shell with cmd, only returns when the exec failed
+void exec_command(Cmd* cmd) {
+	char cwd[PATH_MAX];
+	if(getcwd(cwd,PATH_MAX)==NULL) cwd[0]='\0';
+	expand_path(cmd->current,cwd,get_var("PATH"),pathbuf);
+	// too long a command is left for the caller, which runs it the usual way to report it
+	if(!args_fit(cmd,false)) return;
+	fflush(stdout);
+	// the redirections stay in place when the exec fails, like for the exec builtin,
+	// so a script whose last command cannot open its files just ends there
+	if(!open_redirects(cmd)) exit(1);
+	bool applied=apply_redirects(cmd,false);
+	close_redirects(cmd);
+	if(!applied) exit(1);
+	restore_sigmask();
+	execve(pathbuf,cmd->current.items,stage_env(cmd->tmpvars,pathbuf));
+	shell_signals();
+}
+
+int builtin_exit(Cmd* cmd,StrArr* history,int status) {
+	StrArr args=cmd->current;
+	(void)history;
+	if(args.len==1) exit(WEXITSTATUS(status));
+	exit(atoi(args.items[1]));
+}
+
+int builtin_exec(Cmd* cmd,StrArr* history,int status) {
+	(void)history;
+	(void)status;
+	if(cmd->current.len==1) return 0;
+	Cmd target={.current={cmd->current.items+1,0,cmd->current.len-1},.tmpvars=cmd->tmpvars};
+	exec_command(&target);
+	fprintf(stderr,"%s: exec: %s: %s\n",pname,target.current.items[0],strerror(errno));
+	return errno==ENOENT?127:126;
+}
+
+int builtin_cd(Cmd* cmd,StrArr* history,int status) {
+	StrArr args=cmd->current;
+	(void)history;
+	(void)status;
+	char* newdir;
+	if(args.len==1) {
+		newdir=get_var("HOME");
+		if(newdir==NULL || *newdir=='\0') return 0;
+	} else {
+		newdir=args.items[1];
+	}
+	if(chdir(newdir)<0) {
+		fprintf(stderr,"%s: cd %s: %s\n",pname,newdir,strerror(errno));
+		return 1;
+	}
+	// scripts never build a prompt, so PWD is kept current here instead
+	char cwd[PATH_MAX];
+	if(getcwd(cwd,PATH_MAX)) set_var("PWD",3,cwd,true);
+	return 0;
+}
+
+int builtin_export(Cmd* cmd,StrArr* history,int status) {
+	StrArr args=cmd->current;
+	(void)history;
+	(void)status;
+	if(args.len==1) {
+		for(size_t i=0; i<vars.cap; i++) {
+			if(vars.items[i].entry && vars.items[i].exported) printf("export %s\n",vars.items[i].entry);
+		}
+		return 0;
+	}
+	int res=0;
+	for(size_t i=1; i<args.len; i++) {
+		char* eq=strchr(args.items[i],'=');
+		size_t len=eq?(size_t)(eq-args.items[i]):strlen(args.items[i]);
+		bool valid=len>0 && !isdigit(args.items[i][0]);
+		for(size_t j=0; j<len && valid; j++) valid=is_name_char(args.items[i][j]);
+		if(!valid) {
+			fprintf(stderr,"%s: export: %s: not a valid identifier\n",pname,args.items[i]);
+			res=1;
+			continue;
+		}
+		char* value=eq?eq+1:lookup_var(args.items[i],len);
+		if(value) set_var(args.items[i],len,value,true);
+	}
+	return res;
+}
+
+int builtin_hash(Cmd* cmd,StrArr* history,int status) {
+	StrArr args=cmd->current;
+	(void)history;
+	(void)status;
+	if(args.len==1) {
+		if(path_hash.len==0) {
+			printf("%s: hash table empty\n",pname);
+			return 0;
+		}
+		printf("hits\tcommand\n");
+		for(size_t i=0; i<path_hash.cap; i++) {
+			if(path_hash.items[i].name==NULL) continue;
+			printf("%4zu\t%s\n",path_hash.items[i].hits,path_hash.items[i].path);
+		}
+		return 0;
+	}
+	int res=0;
+	for(size_t i=1; i<args.len; i++) {
+		char* name=args.items[i];
+		if(strcmp(name,"-r")==0) {
+			path_hash_clear();
+			continue;
+		}
+		char* pathenv=get_var("PATH");
+		if(strchr(name,'/') || pathenv==NULL) continue;
+		path_hash_validate(pathenv);
+		path_hash_remove(name);
+		char resolved[PATH_MAX];
+		expand_path((StrArr) {.items=&name,.len=1},"",pathenv,resolved);
+		if(resolved[0]=='\0') {
+			fprintf(stderr,"%s: hash: %s: not found\n",pname,name);
+			res=1;
+			continue;
+		}
+		path_hash_find(name)->hits=0;
+	}
+	return res;
+}
+
+int builtin_history(Cmd* cmd,StrArr* history,int status) {
+	StrArr args=cmd->current;
+	(void)status;
+	if(args.len==1) {
+		for(size_t i=0; i<history->len; i++) printf("%5zu  %s\n",i+1,history->items[i]);
+		return 0;
+	}
+	if(strcmp(args.items[1],"-r")==0) {
+		if(history_lock(history)) {
+			history_read_new(history);
+			flock(histfd,LOCK_UN);
+		}
+		return 0;
+	}
+	if(strcmp(args.items[1],"-k")==0) {
+		compact_history(true);
+		return 0;
+	}
+	fprintf(stderr,"%s: history: %s: invalid option\n",pname,args.items[1]);
+	return 1;
+}
+
+int builtin_version(Cmd* cmd,StrArr* history,int status) {
+	(void)cmd;
+	(void)history;
+	(void)status;
+	version(pname,stdout);
+	return 0;
+}
+
+int builtin_help(Cmd* cmd,StrArr* history,int status) {
+	(void)cmd;
+	(void)history;
+	(void)status;
+	help(pname,stdout);
+	return 0;
+}
+
+// Finds the job named by a `%n` or `n` spec, or the most recent one without it
+Job* find_job(char* spec,char* builtin) {
+	if(spec==NULL) {
+		if(jobs.len) return &jobs.items[jobs.len-1];
+		fprintf(stderr,"%s: %s: no current job\n",pname,builtin);
+		return NULL;
+	}
+	char* end;
+	size_t id=strtoull(spec+(spec[0]=='%'),&end,10);
+	for(size_t i=0; i<jobs.len && *end=='\0'; i++) {
+		if(jobs.items[i].id==id) return &jobs.items[i];
+	}
+	fprintf(stderr,"%s: %s: %s: no such job\n",pname,builtin,spec);
+	return NULL;
+}
+
+int builtin_jobs(Cmd* cmd,StrArr* history,int status) {
+	(void)cmd;
+	(void)history;
+	(void)status;
+	reap_jobs();
+	report_jobs(true);
+	return 0;
+}
+
+int builtin_fg(Cmd* cmd,StrArr* history,int status) {
+	(void)history;
+	(void)status;
+	Job* job=find_job(cmd->current.items[1],"fg");
+	if(job==NULL) return 1;
+	fprintf(stderr,"%s\n",job->command);
+	return foreground_job(job);
+}
+
+int builtin_bg(Cmd* cmd,StrArr* history,int status) {
+	(void)history;
+	(void)status;
+	Job* job=find_job(cmd->current.items[1],"bg");
+	if(job==NULL) return 1;
+	if(job->state!=JOB_STOPPED) return 0;
+	kill(-job->pgid,SIGCONT);
+	for(size_t i=0; i<job->nprocs; i++) job->procs[i].stopped=false;
+	update_job_state(job);
+	job->notify=false;
+	fprintf(stderr,"[%zu] %s &\n",job->id,job->command);
+	return 0;
+}
+
+// Waits for a running job and forgets it, stopped jobs are left alone
+int wait_job(Job* job) {
+	if(job->state==JOB_STOPPED) return 128+SIGTSTP;
+	wait_job_state(job);
+	if(job->state==JOB_STOPPED) return 128+SIGTSTP;
+	if(job->state==JOB_RUNNING) return 128+SIGINT;
+	int code=job_exit_code(job);
+	remove_job(job);
+	return code;
+}
+
+int builtin_wait(Cmd* cmd,StrArr* history,int status) {
+	(void)history;
+	(void)status;
+	int code=0;
+	if(cmd->current.len<2) {
+		for(size_t i=0; i<jobs.len && !sigint_caught;) {
+			if(jobs.items[i].state==JOB_RUNNING) code=wait_job(&jobs.items[i]);
+			else i++;
+		}
+		return code;
+	}
+	for(size_t i=1; i<cmd->current.len && !sigint_caught; i++) {
+		Job* job=find_job(cmd->current.items[i],"wait");
+		code=job?wait_job(job):127;
+	}
+	return code;
+}
+
+int builtin_true(Cmd* cmd,StrArr* history,int status) {
+	(void)cmd;
+	(void)history;
+	(void)status;
+	return 0;
+}
+
+int builtin_false(Cmd* cmd,StrArr* history,int status) {
+	(void)cmd;
+	(void)history;
+	(void)status;
+	return 1;
+}
+
+int builtin_pwd(Cmd* cmd,StrArr* history,int status) {
+	(void)cmd;
+	(void)history;
+	(void)status;
+	char cwd[PATH_MAX];
+	if(getcwd(cwd,PATH_MAX)==NULL) {
+		fprintf(stderr,"%s: pwd: %s\n",pname,strerror(errno));
+		return 1;
+	}
+	printf("%s\n",cwd);
+	return 0;
+}
+
+// Prints str interpreting backslash escapes, returns false on \c (stop all output)
+bool print_escaped(char* str,size_t len) {
+	for(size_t i=0; i<len; i++) {
+		if(str[i]!='\\' || i+1>=len) {
+			putchar(str[i]);
+			continue;
+		}
+		switch(str[++i]) {
+			case 'a': putchar('\a'); break;
+			case 'b': putchar('\b'); break;
+			case 'c': return false;
+			case 'e': putchar('\x1b'); break;
+			case 'f': putchar('\f'); break;
+			case 'n': putchar('\n'); break;
+			case 'r': putchar('\r'); break;
+			case 't': putchar('\t'); break;
+			case 'v': putchar('\v'); break;
+			case '\\': putchar('\\'); break;
+			case '0': {
+				int value=0;
+				for(size_t j=0; j<3 && i+1<len && str[i+1]>='0' && str[i+1]<='7'; j++) value=value*8+str[++i]-'0';
+				putchar(value);
+				break;
+			}
+			default:
+				putchar('\\');
+				putchar(str[i]);
+		}
+	}
+	return true;
+}
+
+int builtin_echo(Cmd* cmd,StrArr* history,int status) {
+	StrArr args=cmd->current;
+	(void)history;
+	(void)status;
+	bool newline=true;
+	bool escapes=false;
+	size_t i=1;
+	for(; i<args.len && args.items[i][0]=='-' && args.items[i][1]; i++) {
+		char* opt=args.items[i]+1;
+		if(strspn(opt,"neE")!=strlen(opt)) break;
+		for(; *opt; opt++) {
+			if(*opt=='n') newline=false;
+			if(*opt=='e') escapes=true;
+			if(*opt=='E') escapes=false;
+		}
+	}
+	for(; i<args.len; i++) {
+		if(escapes) {
+			if(!print_escaped(args.items[i],strlen(args.items[i]))) return 0;
+		} else {
+			fputs(args.items[i],stdout);
+		}
+		if(i+1<args.len) putchar(' ');
+	}
+	if(newline) putchar('\n');
+	return 0;
+}
+
+int builtin_printf(Cmd* cmd,StrArr* history,int status) {
+	StrArr args=cmd->current;
+	(void)history;
+	(void)status;
+	if(args.len<2) {
+		fprintf(stderr,"%s: printf: usage: printf format [arguments]\n",pname);
+		return 2;
+	}
+	char* format=args.items[1];
+	size_t arg=2;
+	int res=0;
+	// the format is reused as long as there are arguments left
+	do {
+		size_t consumed=arg;
+		for(char* ch=format; *ch; ch++) {
+			if(*ch=='\\') {
+				size_t len=1;
+				if(ch[1]=='0') {
+					while(len<4 && ch[len+1]>='0' && ch[len+1]<='7') len++;
+				} else if(ch[1]) {
+					len=2;
+				}
+				if(!print_escaped(ch,len)) return res;
+				ch+=len-1;
+				continue;
+			}
+			if(*ch!='%') {
+				putchar(*ch);
+				continue;
+			}
+			if(ch[1]=='%') {
+				putchar('%');
+				ch++;
+				continue;
+			}
+			char spec[32];
+			size_t speclen=0;
+			spec[speclen++]=*ch++;
+			while(*ch && strchr("-+ #0123456789.",*ch) && speclen<sizeof(spec)-3) spec[speclen++]=*ch++;
+			if(*ch=='\0') break;
+			char* value=arg<args.len?args.items[arg++]:NULL;
+			char conv=*ch;
+			switch(conv) {
+				case 'd':
+				case 'i':
+				case 'o':
+				case 'u':
+				case 'x':
+				case 'X':
+				case 'c': {
+					long long number=0;
+					if(conv=='c') number=value?value[0]:0;
+					else if(value) {
+						char* end;
+						errno=0;
+						number=value[0]=='\'' || value[0]=='"'?(unsigned char)value[1]:strtoll(value,&end,0);
+						if(value[0]!='\'' && value[0]!='"' && (errno || *end)) {
+							fprintf(stderr,"%s: printf: %s: invalid number\n",pname,value);
+							res=1;
+						}
+					}
+					if(conv!='c') {
+						spec[speclen++]='l';
+						spec[speclen++]='l';
+					}
+					spec[speclen++]=conv;
+					spec[speclen]='\0';
+					if(conv=='c') printf(spec,(int)number);
+					else printf(spec,number);
+					break;
+				}
+				case 'b':
+					if(value && !print_escaped(value,strlen(value))) return res;
+					break;
+				case 's':
+					spec[speclen++]='s';
+					spec[speclen]='\0';
+					printf(spec,value?value:"");
+					break;
+				default:
+					fprintf(stderr,"%s: printf: %%%c: invalid directive\n",pname,conv);
+					return 1;
+			}
+		}
+		if(arg==consumed) break;
+	} while(arg<args.len);
+	return res;
+}
+
+typedef struct {
+	char** args;
+	size_t len;
+	size_t pos;
+	bool error;
+} TestExpr;
+
+bool test_or(TestExpr* expr);
+
+bool test_unary(char op,char* arg) {
+	struct stat st;
+	switch(op) {
+		case 'n': return arg[0]!='\0';
+		case 'z': return arg[0]=='\0';
+		case 'e': return stat(arg,&st)==0;
+		case 'f': return stat(arg,&st)==0 && S_ISREG(st.st_mode);
+		case 'd': return stat(arg,&st)==0 && S_ISDIR(st.st_mode);
+		case 'b': return stat(arg,&st)==0 && S_ISBLK(st.st_mode);
+		case 'c': return stat(arg,&st)==0 && S_ISCHR(st.st_mode);
+		case 'p': return stat(arg,&st)==0 && S_ISFIFO(st.st_mode);
+		case 'S': return stat(arg,&st)==0 && S_ISSOCK(st.st_mode);
+		case 's': return stat(arg,&st)==0 && st.st_size>0;
+		case 'h':
+		case 'L': return lstat(arg,&st)==0 && S_ISLNK(st.st_mode);
+		case 'r': return access(arg,R_OK)==0;
+		case 'w': return access(arg,W_OK)==0;
+		case 'x': return access(arg,X_OK)==0;
+		case 't': return isatty(atoi(arg));
+	}
+	return false;
+}
+
+bool test_number(TestExpr* expr,char* str,long long* number) {
+	char* end;
+	errno=0;
+	*number=strtoll(str,&end,10);
+	if(errno || end==str || *end) {
+		fprintf(stderr,"%s: test: %s: integer expression expected\n",pname,str);
+		expr->error=true;
+		return false;
+	}
+	return true;
+}
+
+bool test_primary(TestExpr* expr) {
+	if(expr->pos>=expr->len) {
+		expr->error=true;
+		return false;
+	}
+	char* arg=expr->args[expr->pos];
+	if(strcmp(arg,"!")==0) {
+		expr->pos++;
+		return !test_primary(expr);
+	}
+	if(strcmp(arg,"(")==0) {
+		expr->pos++;
+		bool res=test_or(expr);
+		if(expr->pos>=expr->len || strcmp(expr->args[expr->pos],")")!=0) {
+			fprintf(stderr,"%s: test: missing ')'\n",pname);
+			expr->error=true;
+			return false;
+		}
+		expr->pos++;
+		return res;
 	}
-	for(size_t i=(prompt_len+curlen-idx)/term_width+1; i>0; i--) printf("\r\n");
-	tcsetattr(keys_fd,TCSAFLUSH,&initial_state);
-	da_append(command,'\0');
+	if(expr->pos+3<=expr->len) {
+		char* op=expr->args[expr->pos+1];
+		char* rhs=expr->args[expr->pos+2];
+		bool binary=true;
+		bool res=false;
+		long long lnum,rnum;
+		if(strcmp(op,"=")==0 || strcmp(op,"==")==0) res=strcmp(arg,rhs)==0;
+		else if(strcmp(op,"!=")==0) res=strcmp(arg,rhs)!=0;
+		else if(strcmp(op,"<")==0) res=strcmp(arg,rhs)<0;
+		else if(strcmp(op,">")==0) res=strcmp(arg,rhs)>0;
+		else if(op[0]=='-' && strlen(op)==3 && strstr("-eq-ne-lt-le-gt-ge",op)) {
+			if(!test_number(expr,arg,&lnum) || !test_number(expr,rhs,&rnum)) return false;
+			if(strcmp(op,"-eq")==0) res=lnum==rnum;
+			if(strcmp(op,"-ne")==0) res=lnum!=rnum;
+			if(strcmp(op,"-lt")==0) res=lnum<rnum;
+			if(strcmp(op,"-le")==0) res=lnum<=rnum;
+			if(strcmp(op,"-gt")==0) res=lnum>rnum;
+			if(strcmp(op,"-ge")==0) res=lnum>=rnum;
+		} else {
+			binary=false;
+		}
+		if(binary) {
+			expr->pos+=3;
+			return res;
+		}
+	}
+	if(arg[0]=='-' && arg[1] && arg[2]=='\0' && strchr("nzefdbcpSshLrwxt",arg[1]) && expr->pos+1<expr->len) {
+		expr->pos+=2;
+		return test_unary(arg[1],expr->args[expr->pos-1]);
+	}
+	expr->pos++;
+	return arg[0]!='\0';
 }
 
-void add_history(char* command,StrArr* history) {
-	if(history->len>0 && strcmp(command,history->items[history->len-1])==0) return;
-	size_t len=strlen(command);
-	if(len==0) return;
-	// TODO actually use the global histbuf buffer
-	char* copy=malloc(len+1);
-	memcpy(copy,command,len+1);
-	da_append(history,copy);
+bool test_and(TestExpr* expr) {
+	bool res=test_primary(expr);
+	while(!expr->error && expr->pos<expr->len && strcmp(expr->args[expr->pos],"-a")==0) {
+		expr->pos++;
+		res=test_primary(expr) && res;
+	}
+	return res;
 }
 
-void populate_history(StrArr* history,char* homedir) {
-	char histfilename[PATH_MAX];
-	sprintf(histfilename,"%s/.abysh_history",homedir);
-	FILE* histfile=fopen(histfilename,"r");
-	if(histfile==NULL) return;
-	ssize_t count=0;
-	char* curline=NULL;
-	for(size_t n=0,remaining=HIST_BUF_CAP; remaining>0 && (count=getline(&curline,&n,histfile))!=-1 && (size_t)count<remaining; remaining-=count) {
-		char* nl=strchr(curline,'\n');
-		if(nl) *nl='\0';
-		char* line=curline;
-		size_t len=trim(&line);
-		if(len==0) continue;
-		if(history->len>0 && strcmp(history->items[history->len-1],line)==0) continue;
-		memcpy(histbuf+histidx,line,len+1);
-		da_append(history,histbuf+histidx);
-		histidx+=len+1;
+bool test_or(TestExpr* expr) {
+	bool res=test_and(expr);
+	while(!expr->error && expr->pos<expr->len && strcmp(expr->args[expr->pos],"-o")==0) {
+		expr->pos++;
+		res=test_and(expr) || res;
 	}
-	if(curline) free(curline);
-	fclose(histfile);
+	return res;
 }
 
-bool write_history(StrArr history,char* homedir) {
-	char histfilename[PATH_MAX];
-	sprintf(histfilename,"%s/.abysh_history",homedir);
-	FILE* histfile=fopen(histfilename,"w");
-	if(histfile==NULL) return false;
-	// removing pesky trailing exits
-	while(history.len>0 && strcmp(history.items[history.len-1],"exit")==0) history.len--;
-	for(size_t i=0; i<history.len; i++) {
-		fprintf(histfile,"%s\n",history.items[i]);
+int builtin_test(Cmd* cmd,StrArr* history,int status) {
+	StrArr args=cmd->current;
+	(void)history;
+	(void)status;
+	size_t len=args.len;
+	if(strcmp(args.items[0],"[")==0) {
+		if(len<2 || strcmp(args.items[len-1],"]")!=0) {
+			fprintf(stderr,"%s: [: missing ']'\n",pname);
+			return 2;
+		}
+		len--;
 	}
-	fclose(histfile);
-	return true;
+	if(len==1) return 1;
+	TestExpr expr={.args=args.items+1,.len=len-1};
+	bool res=test_or(&expr);
+	if(!expr.error && expr.pos<expr.len) {
+		fprintf(stderr,"%s: test: %s: unexpected argument\n",pname,expr.args[expr.pos]);
+		expr.error=true;
+	}
+	if(expr.error) return 2;
+	return res?0:1;
 }
 
-void populate_env(StrArr tmpvars) {
-	for(size_t i=0; i<tmpvars.len; i++) {
-		char* var=tmpvars.items[i];
-		char* eq=strchr(var,'=');
-		if(var+strlen(var)==eq+1) {
-			*eq='\0';
-			unsetenv(var);
-			continue;
+typedef int (*BuiltinFn)(Cmd* cmd,StrArr* history,int status);
+
+// Pure builtins only print through stdio and leave the shell as it was, so a
+// substitution can capture their output without forking
+typedef struct {
+	char* name;
+	BuiltinFn fn;
+	bool pure;
+} Builtin;
+
+int builtin_parallel(Cmd* cmd,StrArr* history,int status);
+
+Builtin builtins[]={
+	{"exit",builtin_exit,false},
+	{"exec",builtin_exec,false},
+	{"cd",builtin_cd,false},
+	{"export",builtin_export,false},
+	{"hash",builtin_hash,false},
+	{"history",builtin_history,false},
+	{"version",builtin_version,true},
+	{"help",builtin_help,true},
+	{"true",builtin_true,true},
+	{"false",builtin_false,true},
+	{"pwd",builtin_pwd,true},
+	{"echo",builtin_echo,true},
+	{"printf",builtin_printf,true},
+	{"test",builtin_test,true},
+	{"[",builtin_test,true},
+	{"jobs",builtin_jobs,false},
+	{"fg",builtin_fg,false},
+	{"bg",builtin_bg,false},
+	{"wait",builtin_wait,false},
+	{"parallel",builtin_parallel,false},
+};
+
+#define BUILTIN_COUNT (sizeof(builtins)/sizeof(builtins[0]))
+#define BUILTIN_TABLE_CAP 64
+
+// Open addressing table over builtins, filled on first lookup
+Builtin* builtin_table[BUILTIN_TABLE_CAP];
+
+Builtin* find_builtin(char* name) {
+	static bool filled=false;
+	if(!filled) {
+		for(size_t i=0; i<BUILTIN_COUNT; i++) {
+			size_t j=hash_str(builtins[i].name,strlen(builtins[i].name))&(BUILTIN_TABLE_CAP-1);
+			while(builtin_table[j]) j=(j+1)&(BUILTIN_TABLE_CAP-1);
+			builtin_table[j]=&builtins[i];
 		}
-		putenv(var);
+		filled=true;
+	}
+	for(size_t j=hash_str(name,strlen(name))&(BUILTIN_TABLE_CAP-1); builtin_table[j]; j=(j+1)&(BUILTIN_TABLE_CAP-1)) {
+		if(strcmp(builtin_table[j]->name,name)==0) return builtin_table[j];
 	}
+	return NULL;
 }
 
-void version(char* program,FILE* fd) {
-	fprintf(fd,"%s (Abyss Shell) version %s\n",program,VERSION);
+// Candidates of the completion in progress, as offsets into completion_text
+StrBuf completion_text={0};
+Offsets completions={0};
+
+char* completion_at(size_t i) {
+	return completion_text.items+completions.items[i];
 }
 
-void help(char* program,FILE* fd) {
-	version(program,fd);
-	fprintf(fd,"\n");
-	fprintf(fd,"List of builtin commands:\n");
-	fprintf(fd,"    exit           Close the shell\n");
-	fprintf(fd,"    cd directory   Change CWD to directory\n");
-	fprintf(fd,"    version        Prints the version of the shell in a single line\n");
-	fprintf(fd,"    help           Print this help\n");
+void add_completion(char* name) {
+	da_append(&completions,completion_text.len);
+	for(; *name; name++) da_append(&completion_text,*name);
+	da_append(&completion_text,'\0');
+}
+
+int compare_completions(const void* a,const void* b) {
+	return strcmp(completion_text.items+*(size_t*)a,completion_text.items+*(size_t*)b);
+}
+
+void sort_completions(void) {
+	qsort(completions.items,completions.len,sizeof(size_t),compare_completions);
+	size_t kept=0;
+	for(size_t i=0; i<completions.len; i++) {
+		if(kept && strcmp(completion_at(kept-1),completion_at(i))==0) continue;
+		completions.items[kept++]=completions.items[i];
+	}
+	completions.len=kept;
+}
+
+// Adds the entries of the directory part of word that start with the rest of it,
+// directories get a trailing slash
+void complete_files(char* word,size_t len,size_t base) {
+	char dirbuf[PATH_MAX];
+	char* home=get_var("HOME");
+	if(base==0) snprintf(dirbuf,sizeof(dirbuf),".");
+	else if(word[0]=='~' && word[1]=='/' && home) snprintf(dirbuf,sizeof(dirbuf),"%s%.*s",home,(int)base-1,word+1);
+	else snprintf(dirbuf,sizeof(dirbuf),"%.*s",(int)base,word);
+	DIR* dir=opendir(dirbuf);
+	if(dir==NULL) return;
+	struct dirent* entry;
+	while((entry=readdir(dir))) {
+		char* name=entry->d_name;
+		if(strcmp(name,".")==0 || strcmp(name,"..")==0) continue;
+		if(name[0]=='.' && word[base]!='.') continue;
+		if(strncmp(name,word+base,len-base)!=0) continue;
+		bool isdir=entry->d_type==DT_DIR;
+		struct stat st;
+		if((entry->d_type==DT_LNK || entry->d_type==DT_UNKNOWN) && fstatat(dirfd(dir),name,&st,0)==0) isdir=S_ISDIR(st.st_mode);
+		add_completion(name);
+		if(!isdir) continue;
+		completion_text.items[completion_text.len-1]='/';
+		da_append(&completion_text,'\0');
+	}
+	closedir(dir);
+	sort_completions();
+}
+
+void show_completions(Display* d) {
+	size_t width=0;
+	for(size_t i=0; i<completions.len; i++) {
+		size_t len=strlen(completion_at(i));
+		if(len>width) width=len;
+	}
+	width+=2;
+	size_t columns=width<term_width?term_width/width:1;
+	size_t shown=completions.len<COMPLETION_MAX_SHOWN?completions.len:COMPLETION_MAX_SHOWN;
+	display_finish(d);
+	for(size_t i=0; i<shown; i++) {
+		char* name=completion_at(i);
+		display_append(d,name,strlen(name));
+		bool eol=(i+1)%columns==0 || i+1==shown;
+		for(size_t pad=strlen(name); pad<width && !eol; pad++) display_append(d," ",1);
+		if(eol) display_append(d,"\r\n",2);
+	}
+	if(shown<completions.len) {
+		char more[64];
+		int len=snprintf(more,sizeof(more),"... and %zu more\r\n",completions.len-shown);
+		display_append(d,more,len);
+	}
+	display_prompt(d,d->prompt);
+}
+
+bool breaks_word(char ch) {
+	return isspace(ch) || ch=='|' || ch=='&' || ch=='<' || ch=='>' || ch==';' || ch=='(' || ch=='`';
+}
+
+bool command_at(GapBuf* line,size_t i);
+
+// Completes the word that ends at idx: a command name where the highlighter would expect
+// one, a file name otherwise. When there is nothing to insert and list is set (a second
+// Tab) the candidates are printed below the line
+void complete(Display* d,GapBuf* line,size_t* idx,bool list) {
+	static StrBuf word={0};
+	size_t start=*idx;
+	while(start>0 && !(breaks_word(gap_at(line,start-1)) && !(start>=2 && gap_at(line,start-2)=='\\'))) start--;
+	word.len=0;
+	for(size_t i=start; i<*idx; i++) {
+		char ch=gap_at(line,i);
+		if(ch=='"') continue;
+		if(ch=='\\' && i+1<*idx) ch=gap_at(line,++i);
+		da_append(&word,ch);
+	}
+	da_append(&word,'\0');
+	word.len--;
+	size_t base=0;
+	for(size_t i=0; i<word.len; i++) {
+		if(word.items[i]=='/') base=i+1;
+	}
+	completions.len=0;
+	completion_text.len=0;
+	if(base==0 && command_at(line,start)) {
+		for(size_t i=0; i<BUILTIN_COUNT; i++) {
+			if(strncmp(builtins[i].name,word.items,word.len)==0) add_completion(builtins[i].name);
+		}
+		if(cmd_index.fd>=0) cmd_index_read();
+		cmd_index_match(word.items,word.len,add_completion);
+		sort_completions();
+	} else {
+		complete_files(word.items,word.len,base);
+	}
+	if(completions.len==0) return;
+	char* first=completion_at(0);
+	size_t common=strlen(first);
+	for(size_t i=1; i<completions.len; i++) {
+		char* other=completion_at(i);
+		size_t j=0;
+		while(j<common && first[j]==other[j]) j++;
+		common=j;
+	}
+	size_t typed=word.len-base;
+	if(common>typed || completions.len==1) {
+		for(size_t i=typed; i<common; i++) {
+			if(strchr(" \t\\\"|&<>#$;`",first[i])) gap_insert(line,(*idx)++,"\\",1);
+			gap_insert(line,(*idx)++,first+i,1);
+		}
+		if(completions.len==1 && first[common-1]!='/') gap_insert(line,(*idx)++," ",1);
+		return;
+	}
+	if(list) show_completions(d);
 }
 
-bool handle_builtin(Cmd cmd,int* status,StrArr history,char* homedir) {
-	if(strcmp(cmd.current.items[0],"exit")==0) {
-		write_history(history,homedir);
-		if(cmd.current.len==1) {
-			exit(WEXITSTATUS(*status));
+// What the word at a token start is expected to be, a redirection target can
+// come anywhere and leaves the rest as it was
+enum {
+	LEX_COMMAND,
+	LEX_ARG,
+	LEX_FOR_NAME,
+	LEX_FOR_IN,
+	LEX_TARGET=0x10,
+};
+
+typedef struct {
+	size_t start;
+	unsigned char state;
+} LexToken;
+
+typedef struct {
+	LexToken* items;
+	size_t cap;
+	size_t len;
+} LexTokens;
+
+// The line as last highlighted with the style of every character, and where its tokens
+// start along with the lexer state there. An edit lexes again from the token it touched
+// until a token lines up with an old one in the same state, everything after is kept
+typedef struct {
+	StrBuf text;
+	StrBuf styles;
+	LexTokens tokens;
+	LexTokens relexed;
+	bool indexed;
+} Highlight;
+
+Highlight highlighter={0};
+
+void buf_reserve(StrBuf* buf,size_t len) {
+	if(len<=buf->cap) return;
+	buf->cap=len*2;
+	buf->items=realloc(buf->items,buf->cap);
+}
+
+// Whether a command runs, from the builtins, the hash and the command index so that
+// no keystroke has to search PATH. Until the index is complete a miss proves nothing
+Style command_style(char* word,size_t len) {
+	char name[PATH_MAX];
+	if(len>=PATH_MAX) return STYLE_PLAIN;
+	memcpy(name,word,len);
+	name[len]='\0';
+	if(memchr(name,'/',len)) {
+		struct stat st;
+		return stat(name,&st)==0 && !S_ISDIR(st.st_mode) && access(name,X_OK)==0?STYLE_COMMAND:STYLE_UNKNOWN;
+	}
+	if(find_builtin(name)) return STYLE_COMMAND;
+	PathHashEntry* entry=path_hash_find(name);
+	if(entry && entry->name) return STYLE_COMMAND;
+	if(cmd_index_has(name)) return STYLE_COMMAND;
+	return cmd_index.fd<0?STYLE_UNKNOWN:STYLE_PLAIN;
+}
+
+// Styles the parts of the word at i the way compile_word splits them up
+size_t highlight_word(Highlight* hl,size_t i) {
+	char* line=hl->text.items;
+	size_t len=hl->text.len;
+	size_t start=i;
+	while(!ends_word(line,len,i)) {
+		char ch=line[i];
+		size_t end=i+1;
+		Style style=STYLE_PLAIN;
+		if(ch=='\\') {
+			if(i+1<len) end++;
+		} else if(ch=='"') {
+			style=STYLE_STRING;
+			while(end<len && line[end]!='"') end+=line[end]=='\\' && end+1<len?2:1;
+			if(end<len) end++;
+		} else if((ch=='$' && i+1<len && line[i+1]=='(') || ch=='`') {
+			style=STYLE_VAR;
+			size_t close;
+			end=subst_end(line,len,ch=='`'?i+1:i+2,ch=='`'?'`':')',&close)?close+1:len;
+		} else if(ch=='$' && i+1<len && (line[i+1]=='?' || is_name_char(line[i+1]))) {
+			style=STYLE_VAR;
+			end=i+2;
+			while(line[i+1]!='?' && end<len && is_name_char(line[end])) end++;
+		} else if(ch=='~' && i==start && (ends_word(line,len,i+1) || line[i+1]=='/')) {
+			style=STYLE_VAR;
 		}
-		int res=atoi(cmd.current.items[1]);
-		exit(res);
+		memset(hl->styles.items+i,style,end-i);
+		i=end;
+	}
+	return i;
+}
+
+// Styles the token at i and moves state on to what may come after it
+size_t highlight_token(Highlight* hl,size_t i,unsigned char* state) {
+	static char* keywords[]={"if","then","elif","else","fi","while","do","done","for","time"};
+	char* line=hl->text.items;
+	size_t len=hl->text.len;
+	char* styles=hl->styles.items;
+	size_t end=i+1;
+	Redir redir;
+	size_t oplen;
+	if(line[i]=='#') {
+		while(end<len && line[end]!='\n') end++;
+		memset(styles+i,STYLE_COMMENT,end-i);
+		return end;
 	}
-	if(strcmp(cmd.current.items[0],"cd")==0) {
-		char* newdir;
-		if(cmd.current.len==1) {
-			newdir=getenv("HOME");
-			if(newdir==NULL || *newdir=='\0') return true;
+	if(line[i]=='\n' || line[i]==';' || line[i]=='|' || (line[i]=='&' && !(i+1<len && line[i+1]=='>'))) {
+		if(line[i]!='\n' && line[i]!=';' && end<len && line[end]==line[i]) end++;
+		memset(styles+i,STYLE_OP,end-i);
+		*state=LEX_COMMAND;
+		return end;
+	}
+	if((oplen=redir_op(line,len,i,&redir))) {
+		end=i+oplen;
+		if(redir.kind==REDIR_DUP) {
+			while(end<len && line[end]!='\n' && isspace(line[end])) end++;
+			while(end<len && isdigit(line[end])) end++;
 		} else {
-			newdir=cmd.current.items[1];
+			*state|=LEX_TARGET;
 		}
-		int res=chdir(newdir);
-		if(res<0) {
-			fprintf(stderr,"%s: cd %s: %s\n",pname,newdir,strerror(errno));
-			*status=256;
-			return true;
+		memset(styles+i,STYLE_OP,end-i);
+		return end;
+	}
+	end=highlight_word(hl,i);
+	unsigned char at=*state&~LEX_TARGET;
+	if(*state&LEX_TARGET) {
+		*state=at;
+		return end;
+	}
+	if(at==LEX_FOR_NAME) {
+		memset(styles+i,STYLE_VAR,end-i);
+		*state=LEX_FOR_IN;
+		return end;
+	}
+	if(at==LEX_FOR_IN) {
+		if(end-i==2 && strncmp(line+i,"in",2)==0) memset(styles+i,STYLE_KEYWORD,2);
+		*state=LEX_ARG;
+		return end;
+	}
+	if(at!=LEX_COMMAND) return end;
+	size_t eq=i;
+	while(eq<end && is_name_char(line[eq])) eq++;
+	if(eq>i && eq<end && line[eq]=='=' && !isdigit(line[i])) {
+		memset(styles+i,STYLE_VAR,eq+1-i);
+		return end;
+	}
+	for(size_t k=0; k<sizeof(keywords)/sizeof(keywords[0]); k++) {
+		if(end-i!=strlen(keywords[k]) || strncmp(line+i,keywords[k],end-i)!=0) continue;
+		memset(styles+i,STYLE_KEYWORD,end-i);
+		// only a separator may follow the end of a compound command
+		if(strcmp(keywords[k],"fi")==0 || strcmp(keywords[k],"done")==0) *state=LEX_ARG;
+		else if(strcmp(keywords[k],"for")==0) *state=LEX_FOR_NAME;
+		return end;
+	}
+	*state=LEX_ARG;
+	// a name that still needs expanding cannot be looked up
+	for(size_t k=i; k<end; k++) {
+		if(strchr("\\\"$`~",line[k])) return end;
+	}
+	memset(styles+i,command_style(line+i,end-i),end-i);
+	return end;
+}
+
+// Styles for every character of text, only what the last edit could have changed is
+// lexed again and only commands in that part are looked up
+char* highlight(Text text) {
+	Highlight* hl=&highlighter;
+	size_t oldlen=hl->text.len;
+	size_t len=text_len(text);
+	size_t diff=0;
+	size_t tail=0;
+	// once the index is complete commands it did not find turn into unknown ones
+	bool indexed=cmd_index.fd<0;
+	if(indexed==hl->indexed) {
+		while(diff<len && diff<oldlen && text_at(text,diff)==hl->text.items[diff]) diff++;
+		while(tail<len-diff && tail<oldlen-diff && text_at(text,len-1-tail)==hl->text.items[oldlen-1-tail]) tail++;
+		if(diff==len && diff==oldlen) return hl->styles.items;
+	}
+	hl->indexed=indexed;
+	buf_reserve(&hl->text,len);
+	buf_reserve(&hl->styles,len);
+	memmove(hl->text.items+len-tail,hl->text.items+oldlen-tail,tail);
+	memmove(hl->styles.items+len-tail,hl->styles.items+oldlen-tail,tail);
+	for(size_t i=diff; i<len-tail; i++) hl->text.items[i]=text_at(text,i);
+	hl->text.len=len;
+	hl->styles.len=len;
+	// start over from the token the edit is in or right after
+	LexTokens* tokens=&hl->tokens;
+	size_t lo=0;
+	size_t hi=tokens->len;
+	while(lo<hi) {
+		size_t mid=(lo+hi)/2;
+		if(tokens->items[mid].start<diff) lo=mid+1;
+		else hi=mid;
+	}
+	size_t first=lo?lo-1:0;
+	size_t i=0;
+	unsigned char state=LEX_COMMAND;
+	if(lo) {
+		i=tokens->items[first].start;
+		state=tokens->items[first].state;
+	}
+	size_t old=first;
+	bool synced=false;
+	hl->relexed.len=0;
+	while(1) {
+		while(i<len && hl->text.items[i]!='\n' && isspace(hl->text.items[i])) hl->styles.items[i++]=STYLE_PLAIN;
+		if(i>=len) break;
+		if(i>=len-tail) {
+			while(old<tokens->len && tokens->items[old].start+len<i+oldlen) old++;
+			synced=old<tokens->len && tokens->items[old].start+len==i+oldlen && tokens->items[old].state==state;
+			if(synced) break;
 		}
-		*status=0;
-		return true;
+		da_append(&hl->relexed,((LexToken) {.start=i,.state=state}));
+		i=highlight_token(hl,i,&state);
 	}
-	if(strcmp(cmd.current.items[0],"version")==0) {
-		version(pname,stdout);
-		return true;
+	size_t kept=synced?tokens->len-old:0;
+	if(first+hl->relexed.len+kept>tokens->cap) {
+		tokens->cap=(first+hl->relexed.len+kept)*2;
+		tokens->items=realloc(tokens->items,tokens->cap*sizeof(LexToken));
 	}
-	if(strcmp(cmd.current.items[0],"help")==0) {
-		help(pname,stdout);
-		return true;
+	memmove(tokens->items+first+hl->relexed.len,tokens->items+old,kept*sizeof(LexToken));
+	for(size_t k=0; k<kept; k++) tokens->items[first+hl->relexed.len+k].start+=len-oldlen;
+	memcpy(tokens->items+first,hl->relexed.items,hl->relexed.len*sizeof(LexToken));
+	tokens->len=first+hl->relexed.len+kept;
+	return hl->styles.items;
+}
+
+// The state the lexer was in where a token of the last highlighted line starts at i,
+// -1 when i is inside a token
+int lex_state_at(size_t i) {
+	LexTokens* tokens=&highlighter.tokens;
+	size_t lo=0;
+	size_t hi=tokens->len;
+	while(lo<hi) {
+		size_t mid=(lo+hi)/2;
+		if(tokens->items[mid].start<i) lo=mid+1;
+		else hi=mid;
 	}
-	return false;
+	return lo<tokens->len && tokens->items[lo].start==i?tokens->items[lo].state:-1;
+}
+
+// Whether the line break at i of the last highlighted line ends a command, it does not
+// inside a string or where a command has yet to come
+bool highlight_ends_command(size_t i) {
+	int state=lex_state_at(i);
+	return state>=0 && state!=LEX_COMMAND;
+}
+
+// Whether a command name goes at i of line, judging by the text before i only. Inside
+// $( or ` a command comes first as well, the highlighter takes those as one word
+bool command_at(GapBuf* line,size_t i) {
+	static StrBuf text={0};
+	if(i>0 && (gap_at(line,i-1)=='(' || gap_at(line,i-1)=='`')) return true;
+	text.len=0;
+	gap_copy(line,0,i,&text);
+	da_append(&text,'x');
+	highlight(str_text(text.items,text.len));
+	return lex_state_at(i)==LEX_COMMAND;
+}
+
+#if USE_POSIX_SPAWN
+// Launches a pipeline stage without copying the shell's address space,
+// the redirections and process group are applied by posix_spawn itself,
+// a negative first leaves the child in the shell's process group. tty is as for
+// fork_stage, where glibc cannot do that the shell hands the terminal over right after
+pid_t spawn_stage(Cmd* current,pid_t first,int lastpipe[2],int nextpipe[2],bool tty) {
+	if(!args_fit(current,true)) return -1;
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawnattr_init(&attr);
+	short flags=POSIX_SPAWN_SETSIGMASK|POSIX_SPAWN_SETSIGDEF;
+	if(first>=0) flags|=POSIX_SPAWN_SETPGROUP;
+	posix_spawnattr_setflags(&attr,flags);
+	posix_spawnattr_setpgroup(&attr,first);
+	posix_spawnattr_setsigmask(&attr,&shell_sigmask);
+	posix_spawnattr_setsigdefault(&attr,&ignored_signals);
+	if(lastpipe[0]>=0) {
+		posix_spawn_file_actions_adddup2(&actions,lastpipe[0],STDIN_FILENO);
+		posix_spawn_file_actions_addclose(&actions,lastpipe[0]);
+	}
+	if(lastpipe[1]>=0) posix_spawn_file_actions_addclose(&actions,lastpipe[1]);
+	if(nextpipe[1]>=0) {
+		posix_spawn_file_actions_adddup2(&actions,nextpipe[1],STDOUT_FILENO);
+		posix_spawn_file_actions_addclose(&actions,nextpipe[1]);
+	}
+	if(nextpipe[0]>=0) posix_spawn_file_actions_addclose(&actions,nextpipe[0]);
+	for(size_t i=0; i<current->redirects.len; i++) {
+		posix_spawn_file_actions_adddup2(&actions,current->redirects.items[i].src,current->redirects.items[i].fd);
+	}
+#ifdef SPAWN_TCSETPGRP
+	// signals are all blocked until the child execs, SIGTTOU cannot stop it either
+	if(tty && first==0) posix_spawn_file_actions_addtcsetpgrp_np(&actions,STDIN_FILENO);
+#else
+	(void)tty;
+#endif
+	fflush(stdout);
+	pid_t pid=-1;
+	int res=posix_spawn(&pid,pathbuf,&actions,&attr,current->current.items,stage_env(current->tmpvars,pathbuf));
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	if(res!=0) {
+		fprintf(stderr,"Unknown command: %s\n",current->current.items[0]);
+		return -1;
+	}
+	return pid;
+}
+#endif
+
+// Plain fork+exec, kept for stages that need to run shell code in the child
+// such as builtins inside a pipeline. With tty set a stage that starts a new group
+// makes it the terminal's foreground group before it can read from it
+pid_t fork_stage(Cmd* current,pid_t first,int lastpipe[2],int nextpipe[2],Builtin* builtin,StrArr* history,int status,bool tty) {
+	if(builtin==NULL && !args_fit(current,true)) return -1;
+	fflush(stdout);
+	pid_t pid=fork();
+	if(pid<0) {
+		fprintf(stderr,"%s: fork: %s\n",pname,strerror(errno));
+		return -1;
+	}
+	if(pid>0) {
+		if(first>=0) setpgid(pid,first);
+		return pid;
+	}
+	if(first>=0) setpgid(0,first);
+	// still ignoring SIGTTOU here, so taking the terminal cannot stop the child
+	if(tty && first==0) tcsetpgrp(STDIN_FILENO,getpid());
+	restore_sigmask();
+	if(lastpipe[0]>=0) {
+		dup2(lastpipe[0],STDIN_FILENO);
+		close(lastpipe[0]);
+	}
+	if(lastpipe[1]>=0) close(lastpipe[1]);
+	if(nextpipe[1]>=0)  {
+		dup2(nextpipe[1],STDOUT_FILENO);
+		close(nextpipe[1]);
+	}
+	if(nextpipe[0]>=0) close(nextpipe[0]);
+	if(!apply_redirects(current,false)) _exit(1);
+	if(builtin) {
+		int res=builtin->fn(current,history,status);
+		fflush(stdout);
+		_exit(res);
+	}
+	int res=execve(pathbuf,current->current.items,stage_env(current->tmpvars,pathbuf));
+	if(res<0) {
+		fprintf(stderr,"Unknown command: %s\n",current->current.items[0]);
+		exit(127);
+	}
+	fprintf(stderr,"%s: internal error\n",pname);
+	exit(1);
+}
+
+typedef struct {
+	pid_t pid;
+	int out;
+	int err;
+} ParallelSlot;
+
+// Hands out stdin one line at a time, reading it in blocks as more lines are needed
+char* read_item(StrBuf* buf,size_t* pos,bool* eof) {
+	while(1) {
+		char* nl=*pos<buf->len?memchr(buf->items+*pos,'\n',buf->len-*pos):NULL;
+		if(nl || (*eof && *pos<buf->len)) {
+			char* item=buf->items+*pos;
+			if(nl==NULL) {
+				da_append(buf,'\0');
+				item=buf->items+*pos;
+				nl=buf->items+buf->len-1;
+			}
+			*nl='\0';
+			*pos=nl-buf->items+1;
+			return item;
+		}
+		if(*eof) return NULL;
+		memmove(buf->items,buf->items+*pos,buf->len-*pos);
+		buf->len-=*pos;
+		*pos=0;
+		while(buf->len+INPUT_READ_BLOCK>buf->cap) {
+			buf->cap=buf->cap?buf->cap*2:INPUT_READ_BLOCK;
+			buf->items=realloc(buf->items,buf->cap);
+		}
+		ssize_t count=read(STDIN_FILENO,buf->items+buf->len,INPUT_READ_BLOCK);
+		if(count<0 && errno==EINTR) continue;
+		if(count<=0) *eof=true;
+		else buf->len+=count;
+	}
+}
+
+// An unnamed temporary file for holding back the output of a job
+int scratch_file(void) {
+	char name[PATH_MAX];
+	char* tmpdir=get_var("TMPDIR");
+	snprintf(name,sizeof(name),"%s/abysh-parallel-XXXXXX",tmpdir && *tmpdir?tmpdir:"/tmp");
+	int fd=mkstemp(name);
+	if(fd<0) return -1;
+	unlink(name);
+	fcntl(fd,F_SETFD,FD_CLOEXEC);
+	return fd;
+}
+
+void copy_output(int from,int to) {
+	char block[INPUT_READ_BLOCK];
+	ssize_t count;
+	lseek(from,0,SEEK_SET);
+	while((count=read(from,block,sizeof(block)))>0) {
+		for(ssize_t done=0; done<count;) {
+			ssize_t res=write(to,block+done,count-done);
+			if(res<0 && errno==EINTR) continue;
+			if(res<0) return;
+			done+=res;
+		}
+	}
+}
+
+// Builds the arguments of one job, every {} is replaced by item and without any
+// the item is appended as the last argument
+void parallel_args(StrArr template,char* item,StrBuf* text,StrArr* args) {
+	bool used=false;
+	text->len=0;
+	args->len=0;
+	for(size_t i=0; i<=template.len; i++) {
+		char* arg=i<template.len?template.items[i]:item;
+		if(i==template.len && used) break;
+		da_append(args,(char*)(uintptr_t)text->len);
+		for(size_t j=0; arg[j]; j++) {
+			if(i<template.len && arg[j]=='{' && arg[j+1]=='}') {
+				for(char* ch=item; *ch; ch++) da_append(text,*ch);
+				used=true;
+				j++;
+				continue;
+			}
+			da_append(text,arg[j]);
+		}
+		da_append(text,'\0');
+	}
+	for(size_t i=0; i<args->len; i++) args->items[i]=text->items+(uintptr_t)args->items[i];
+	da_append(args,NULL);
+	args->len--;
+}
+
+// parallel [-j N] [-g] command [arg...] [::: item...]
+// Runs command once per item (the lines of stdin without :::), keeping at most N of them
+// running. Stdin must not be the script the shell itself reads, or it would eat the rest. With -g the output of each job is held back and printed in one piece once it
+// finishes. The status is the number of failed jobs, 101 meaning more than 100
+int builtin_parallel(Cmd* cmd,StrArr* history,int status) {
+	StrArr args=cmd->current;
+	(void)history;
+	(void)status;
+	long slots=sysconf(_SC_NPROCESSORS_ONLN);
+	bool grouped=false;
+	size_t i=1;
+	for(; i<args.len && args.items[i][0]=='-'; i++) {
+		if(strcmp(args.items[i],"-g")==0) {
+			grouped=true;
+		} else if(strncmp(args.items[i],"-j",2)==0) {
+			char* count=args.items[i][2]?args.items[i]+2:args.items[++i];
+			slots=count?atol(count):0;
+			if(slots<=0) {
+				fprintf(stderr,"%s: parallel: -j expects a positive number\n",pname);
+				return 2;
+			}
+		} else if(strcmp(args.items[i],"--")==0) {
+			i++;
+			break;
+		} else {
+			fprintf(stderr,"%s: parallel: %s: unknown option\n",pname,args.items[i]);
+			return 2;
+		}
+	}
+	if(slots<1) slots=1;
+	StrArr template={args.items+i,0,0};
+	while(i<args.len && strcmp(args.items[i],":::")!=0) i++;
+	template.len=args.items+i-template.items;
+	if(template.len==0) {
+		fprintf(stderr,"usage: parallel [-j N] [-g] command [arg...] [::: item...]\n");
+		return 2;
+	}
+	bool from_stdin=i>=args.len;
+	struct stat st;
+	bool script=from_stdin && script_on_stdin && fstat(STDIN_FILENO,&st)==0;
+	if(script && st.st_dev==script_stdin.st_dev && st.st_ino==script_stdin.st_ino) {
+		fprintf(stderr,"%s: parallel: stdin is the script, give the items after ::: or redirect it\n",pname);
+		return 2;
+	}
+	size_t next=i+1;
+	static StrBuf input={0};
+	static StrBuf text={0};
+	static StrArr jobargs={0};
+	size_t inpos=0;
+	bool eof=false;
+	input.len=0;
+	char cwd[PATH_MAX];
+	if(getcwd(cwd,PATH_MAX)==NULL) cwd[0]='\0';
+	int devnull=open("/dev/null",O_RDONLY|O_CLOEXEC);
+	ParallelSlot* running=calloc(slots,sizeof(ParallelSlot));
+	long nrunning=0;
+	size_t failed=0;
+	bool interrupted=false;
+	// the jobs stay in the shell's process group, so C-c reaches them but must not end the shell
+	SignalState oldint;
+	SignalState oldquit;
+	ignore_signal(SIGINT,&oldint);
+	ignore_signal(SIGQUIT,&oldquit);
+	fflush(stdout);
+	while(1) {
+		while(nrunning<slots && !interrupted) {
+			char* item=from_stdin?read_item(&input,&inpos,&eof):next<args.len?args.items[next++]:NULL;
+			if(item==NULL) break;
+			parallel_args(template,item,&text,&jobargs);
+			Redirect redirects[3]={{.fd=STDIN_FILENO,.src=devnull}};
+			ParallelSlot slot={.out=-1,.err=-1};
+			if(grouped) {
+				slot.out=scratch_file();
+				slot.err=scratch_file();
+				redirects[1]=(Redirect) {.fd=STDOUT_FILENO,.src=slot.out};
+				redirects[2]=(Redirect) {.fd=STDERR_FILENO,.src=slot.err};
+			}
+			// without its temporary files the job just writes straight to the shell's output
+			size_t nredirects=slot.out>=0 && slot.err>=0?3:1;
+			Cmd job={.current=jobargs,.tmpvars=cmd->tmpvars,.redirects={redirects,3,nredirects}};
+			int nopipe[2]={-1,-1};
+			expand_path(job.current,cwd,get_var("PATH"),pathbuf);
+#if USE_POSIX_SPAWN
+			slot.pid=spawn_stage(&job,-1,nopipe,nopipe,false);
+#else
+			slot.pid=fork_stage(&job,-1,nopipe,nopipe,NULL,NULL,0,false);
+#endif
+			if(slot.pid<0) {
+				failed++;
+				if(slot.out>=0) close(slot.out);
+				if(slot.err>=0) close(slot.err);
+				continue;
+			}
+			for(long j=0; j<slots; j++) {
+				if(running[j].pid) continue;
+				running[j]=slot;
+				break;
+			}
+			nrunning++;
+		}
+		if(nrunning==0) break;
+		int wstatus;
+		pid_t pid=waitpid(-1,&wstatus,0);
+		if(pid<0) {
+			if(errno==EINTR) continue;
+			break;
+		}
+		ParallelSlot* slot=NULL;
+		for(long j=0; j<slots && slot==NULL; j++) {
+			if(running[j].pid==pid) slot=&running[j];
+		}
+		if(slot==NULL) {
+			// a background job finished meanwhile
+			update_job(pid,wstatus);
+			continue;
+		}
+		if(!WIFEXITED(wstatus) || WEXITSTATUS(wstatus)!=0) failed++;
+		if(WIFSIGNALED(wstatus) && WTERMSIG(wstatus)==SIGINT) interrupted=true;
+		if(slot->out>=0 && slot->err>=0) {
+			copy_output(slot->out,STDOUT_FILENO);
+			copy_output(slot->err,STDERR_FILENO);
+		}
+		if(slot->out>=0) close(slot->out);
+		if(slot->err>=0) close(slot->err);
+		slot->pid=0;
+		nrunning--;
+	}
+	restore_signal(SIGINT,&oldint);
+	restore_signal(SIGQUIT,&oldquit);
+	free(running);
+	if(devnull>=0) close(devnull);
+	if(interrupted) return 128+SIGINT;
+	return failed>100?101:failed;
+}
+
+double clock_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+double tv_seconds(struct timeval tv) {
+	return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+struct timeval seconds_tv(double seconds) {
+	return (struct timeval) {.tv_sec=seconds,.tv_usec=(seconds-(time_t)seconds)*1e6};
+}
+
+// Pipelines running for at least ABYSH_REPORTTIME seconds are reported as if they were timed
+bool should_report_time(double elapsed) {
+	char* threshold=get_var("ABYSH_REPORTTIME");
+	if(threshold==NULL || *threshold=='\0') return false;
+	char* end;
+	double seconds=strtod(threshold,&end);
+	return *end=='\0' && seconds>=0 && elapsed>=seconds;
+}
+
+void print_usage_line(char* name,double wall,struct rusage* usage) {
+	fprintf(stderr,"%9.3fs %8.3fs %8.3fs %8ldK %7ld %7ld  %s\n",wall,tv_seconds(usage->ru_utime),tv_seconds(usage->ru_stime),usage->ru_maxrss,usage->ru_nvcsw,usage->ru_nivcsw,name);
+}
+
+// Prints the wall clock time and resource usage of every stage, plus a total for pipelines
+void report_time(Cmds* cmds,double elapsed) {
+	struct rusage total={0};
+	double user=0;
+	double sys=0;
+	size_t stages=0;
+	fprintf(stderr,"%10s %9s %9s %9s %7s %7s  %s\n","real","user","sys","maxrss","vcsw","ivcsw","command");
+	for(size_t i=0; i<cmds->len; i++) {
+		Cmd* current=&cmds->items[i];
+		if(current->current.len==0) continue;
+		print_usage_line(current->current.items[0],current->wall,&current->usage);
+		user+=tv_seconds(current->usage.ru_utime);
+		sys+=tv_seconds(current->usage.ru_stime);
+		if(current->usage.ru_maxrss>total.ru_maxrss) total.ru_maxrss=current->usage.ru_maxrss;
+		total.ru_nvcsw+=current->usage.ru_nvcsw;
+		total.ru_nivcsw+=current->usage.ru_nivcsw;
+		stages++;
+	}
+	total.ru_utime=seconds_tv(user);
+	total.ru_stime=seconds_tv(sys);
+	if(stages>1) print_usage_line("total",elapsed,&total);
+}
+
+// Pipe capacity asked for in ABYSH_PIPESIZE, in bytes with an optional K or M suffix,
+// 0 leaves the kernel's default
+int pipe_size_setting(void) {
+	char* setting=get_var("ABYSH_PIPESIZE");
+	if(setting==NULL || !isdigit((unsigned char)*setting)) return 0;
+	char* end;
+	unsigned long long size=strtoull(setting,&end,10);
+	if(*end=='K' || *end=='k') {
+		size<<=10;
+		end++;
+	} else if(*end=='M' || *end=='m') {
+		size<<=20;
+		end++;
+	}
+	return *end=='\0' && size<=INT_MAX?(int)size:0;
+}
+
+// A pipe between two stages, closed on exec so that no other stage holds on to it and
+// sees no EOF. The kernel rounds size up to whole pages or refuses it beyond
+// /proc/sys/fs/pipe-max-size, then the default is kept
+void stage_pipe(int fds[2],int size) {
+	if(pipe(fds)<0) return;
+	fcntl(fds[0],F_SETFD,FD_CLOEXEC);
+	fcntl(fds[1],F_SETFD,FD_CLOEXEC);
+	if(size) fcntl(fds[1],F_SETPIPE_SZ,size);
+}
+
+// Sets PIPESTATUS to the exit status of every stage of the pipeline that just ran,
+// separated by spaces, a stage killed by a signal counts as 128 plus the signal
+void set_pipestatus(Cmds* cmds) {
+	static StrBuf value={0};
+	value.len=0;
+	for(size_t i=0; i<cmds->len; i++) {
+		int status=cmds->items[i].status;
+		char buf[16];
+		int len=snprintf(buf,sizeof(buf),"%s%d",i?" ":"",WIFSIGNALED(status)?128+WTERMSIG(status):WEXITSTATUS(status));
+		for(int j=0; j<len; j++) da_append(&value,buf[j]);
+	}
+	da_append(&value,'\0');
+	set_var("PIPESTATUS",10,value.items,false);
 }
 
-void run_command(Cmds* cmds,StrArr* history,char(*cwd)[PATH_MAX],int* status,char* homedir) {
+void run_command(Cmds* cmds,StrArr* history,char(*cwd)[PATH_MAX],int* status) {
+	for(size_t i=0; i<cmds->len; i++) cmds->items[i].status=0;
 	if(cmds->len && cmds->items[0].current.len) {
+		double start=clock_seconds();
 		int lastpipe[2]={-1,-1};
 		int nextpipe[2]={-1,-1};
-		int allprocspipe[2];
-		pipe(allprocspipe);
+		int pipesize=cmds->len>1?pipe_size_setting():0;
 		pid_t first=0;
+		int failed=0;
+		// foreground pipelines take the terminal while they run, as long as the shell
+		// has it to give, which a script started in the background does not
+		bool tty=!cmds->background && tcgetpgrp(STDIN_FILENO)==getpgid(getpid());
 		for(size_t i=0; i<cmds->len; i++) {
 			bool last=i+1>=cmds->len;
 			Cmd* current=&cmds->items[i];
+			current->pid=0;
 			if(current->current.len==0 || current->current.items[0]==NULL || current->current.items[0][0]=='\0') continue;
-			expand_path(current->current,*cwd,getenv("PATH"),pathbuf);
-			if(handle_builtin(*current,status,*history,homedir)) continue;
-			if(!last) pipe(nextpipe);
-			pid_t pid=fork();
-			if(pid!=0) {
+			Builtin* builtin=find_builtin(current->current.items[0]);
+			if(builtin && cmds->len==1 && !cmds->background) {
+				struct rusage before;
+				getrusage(RUSAGE_SELF,&before);
+				// builtins run with the shell's own descriptors swapped, except that
+				// `exec` keeps its redirections for the rest of the session
+				bool keep=builtin->fn==builtin_exec;
+				fflush(stdout);
+				if(!open_redirects(current)) {
+					*status=current->status=1<<8;
+					continue;
+				}
+				if(apply_redirects(current,!keep)) *status=builtin->fn(current,history,*status)<<8;
+				else *status=1<<8;
+				current->status=*status;
+				fflush(stdout);
+				restore_redirects(current);
+				close_redirects(current);
+				getrusage(RUSAGE_SELF,&current->usage);
+				current->usage.ru_utime=seconds_tv(tv_seconds(current->usage.ru_utime)-tv_seconds(before.ru_utime));
+				current->usage.ru_stime=seconds_tv(tv_seconds(current->usage.ru_stime)-tv_seconds(before.ru_stime));
+				current->usage.ru_nvcsw-=before.ru_nvcsw;
+				current->usage.ru_nivcsw-=before.ru_nivcsw;
+				current->wall=clock_seconds()-start;
+				continue;
+			}
+			if(builtin==NULL) expand_path(current->current,*cwd,get_var("PATH"),pathbuf);
+			if(!last) stage_pipe(nextpipe,pipesize);
+			pid_t pid=-1;
+			if(open_redirects(current)) {
+#if USE_POSIX_SPAWN
+				pid=builtin?fork_stage(current,first,lastpipe,nextpipe,builtin,history,*status,tty):spawn_stage(current,first,lastpipe,nextpipe,tty);
+#else
+				pid=fork_stage(current,first,lastpipe,nextpipe,builtin,history,*status,tty);
+#endif
+				close_redirects(current);
+				if(pid<0) current->status=127<<8;
+				if(pid<0 && last) failed=127;
+			} else {
+				current->status=1<<8;
+				if(last) failed=1;
+			}
+			if(pid>0) {
+				// the terminal goes to the new group before any later stage is started,
+				// a first stage reading from it would be stopped in the meantime
+				if(first==0 && tty) tcsetpgrp(STDIN_FILENO,pid);
 				if(first==0) first=pid;
 				current->pid=pid;
 			}
-			if(pid==0) {
-				int res=0;
-				setpgid(0,first);
-				close(allprocspipe[0]);
-				char* funnychar="E";
-				if(last) write(allprocspipe[1],funnychar,1);
-				close(allprocspipe[1]);
-				if(lastpipe[0]>=0) {
-					dup2(lastpipe[0],STDIN_FILENO);
-					close(lastpipe[0]);
-				}
-				if(lastpipe[1]>=0) close(lastpipe[1]);
-				if(nextpipe[1]>=0)  {
-					dup2(nextpipe[1],STDOUT_FILENO);
-					close(nextpipe[1]);
-				}
-				if(nextpipe[0]>=0) close(nextpipe[0]);
-				da_append(&current->current,NULL);
-				populate_env(current->tmpvars);
-				setenv("_",pathbuf,1);
-				res=execv(pathbuf,current->current.items);
-				if(res<0) {
-					fprintf(stderr,"Unknown command: %s\n",current->current.items[0]);
-					exit(127);
+			if(lastpipe[0]>=0) close(lastpipe[0]);
+			if(lastpipe[1]>=0) close(lastpipe[1]);
+			lastpipe[0]=nextpipe[0];
+			lastpipe[1]=nextpipe[1];
+			nextpipe[0]=-1;
+			nextpipe[1]=-1;
+		}
+		if(lastpipe[0]>=0) close(lastpipe[0]);
+		if(lastpipe[1]>=0) close(lastpipe[1]);
+		if(first && cmds->background) {
+			Job* job=add_job(cmds,JOB_RUNNING);
+			if(job && interactive) fprintf(stderr,"[%zu] %d\n",job->id,job->pgid);
+			*status=0;
+			set_pipestatus(cmds);
+			return;
+		}
+		if(first) {
+			pid_t pid;
+			struct rusage usage;
+			while((pid=wait4(-first,status,WUNTRACED,&usage))>0 || (pid<0 && errno==EINTR)) {
+				if(pid<0) continue;
+				if(WIFSTOPPED(*status)) {
+					stop_job(add_job(cmds,JOB_STOPPED));
+					*status=(128+WSTOPSIG(*status))<<8;
+					return;
 				}
-				fprintf(stderr,"%s: internal error\n",pname);
-				exit(1);
-			} else if(last) {
-				if(lastpipe[0]>=0) close(lastpipe[0]);
-				if(lastpipe[1]>=0) close(lastpipe[1]);
-				close(allprocspipe[1]);
-				char dummybuf[1];
-				read(allprocspipe[0],dummybuf,1);
-				close(allprocspipe[0]);
-				tcsetpgrp(STDIN_FILENO,first);
-				while((pid=waitpid(-first,status,0))>0) {
-					char* command="<none>";
-					for(size_t i=0; i<cmds->len; i++) {
-						Cmd* current=&cmds->items[i];
-						if(current->pid==pid) {
-							command=current->current.items[0];
-							break;
-						}
-					}
-					if(WIFSIGNALED(*status)) {
-						int signal=WTERMSIG(*status);
-						if(signal==SIGPIPE) continue;
-						fprintf(stderr,"child %s (%d) terminated with signal %d (%s)\n",command,pid,signal,strsignal(signal));
+				char* command="<none>";
+				for(size_t i=0; i<cmds->len; i++) {
+					Cmd* current=&cmds->items[i];
+					if(current->pid==pid) {
+						command=current->current.items[0];
+						current->pid=0;
+						current->status=*status;
+						current->usage=usage;
+						current->wall=clock_seconds()-start;
+						break;
 					}
 				}
-				tcsetpgrp(STDIN_FILENO,getpgid(getpid()));
-			} else {
-				if(lastpipe[0]>=0) close(lastpipe[0]);
-				if(lastpipe[1]>=0) close(lastpipe[1]);
-				lastpipe[0]=nextpipe[0];
-				lastpipe[1]=nextpipe[1];
+				if(WIFSIGNALED(*status)) {
+					int signal=WTERMSIG(*status);
+					if(signal==SIGPIPE) continue;
+					fprintf(stderr,"child %s (%d) terminated with signal %d (%s)\n",command,pid,signal,strsignal(signal));
+				}
 			}
+			if(tty) tcsetpgrp(STDIN_FILENO,getpgid(getpid()));
+			// children are reaped in whatever order they exit, the pipeline's status is
+			// that of its last stage
+			*status=cmds->items[cmds->len-1].status;
 		}
+		if(failed) *status=failed<<8;
+		set_pipestatus(cmds);
+		double elapsed=clock_seconds()-start;
+		if(cmds->timed || should_report_time(elapsed)) report_time(cmds,elapsed);
+	} else if(cmds->len && cmds->items[0].redirects.len) {
+		// a line of redirections alone only creates or truncates the files
+		*status=cmds->items[0].status=open_redirects(&cmds->items[0])?0:1<<8;
+		close_redirects(&cmds->items[0]);
+		set_pipestatus(cmds);
 	} else if(cmds->len && cmds->items[0].tmpvars.len) {
 		for(size_t i=0; i<cmds->items[0].tmpvars.len; i++) {
 			size_t tlen=0;
@@ -775,34 +4939,259 @@ void run_command(Cmds* cmds,StrArr* history,char(*cwd)[PATH_MAX],int* status,cha
 			}
 			if(tlen==0) continue;
 			if(tlen+1<arglen) {
-				setenv(cmds->items[0].tmpvars.items[i],cmds->items[0].tmpvars.items[i]+tlen+1,1);
+				set_var(cmds->items[0].tmpvars.items[i],tlen,cmds->items[0].tmpvars.items[i]+tlen+1,false);
 			} else {
-				unsetenv(cmds->items[0].tmpvars.items[i]);
+				unset_var(cmds->items[0].tmpvars.items[i],tlen);
+			}
+		}
+	}
+}
+
+// The shell can only step aside when it has nothing left to do after the command, a
+// timing report is printed once the command finished and a background job must not
+// be waited for at all
+bool can_tail_exec(Cmds* cmds) {
+	if(cmds->len!=1 || cmds->items[0].current.len==0 || cmds->background) return false;
+	char* threshold=get_var("ABYSH_REPORTTIME");
+	if(cmds->timed || (threshold && *threshold)) return false;
+	return find_builtin(cmds->items[0].current.items[0])==NULL;
+}
+
+// Expands and runs one pipeline, with last set nothing comes after it so it can take
+// over the shell process
+void run_pipeline(Program* prog,size_t pipeline,bool last,Runner* r) {
+	sprintf(retbuf,"%d",WEXITSTATUS(r->status));
+	expand_pipeline(prog,prog->pipelines.items[pipeline],&r->cmds,&r->arena,r);
+	if(last && can_tail_exec(&r->cmds)) exec_command(&r->cmds.items[0]);
+	run_command(&r->cmds,r->history,r->cwd,&r->status);
+	arena_reset(&r->arena);
+	// C-c stops the loops and lists around the command as well, not just the command
+	if(WIFSIGNALED(r->status) && WTERMSIG(r->status)==SIGINT) r->interrupted=true;
+}
+
+// C-c with nothing but builtins running reaches the shell itself rather than a job, it
+// stops the loops and lists the same way
+bool check_interrupt(Runner* r) {
+	if(sigint_caught && !r->interrupted) {
+		r->interrupted=true;
+		r->status=(128+SIGINT)<<8;
+	}
+	return r->interrupted;
+}
+
+void run_list(Program* prog,size_t node,Runner* r);
+
+// The words of a for loop are expanded once before the first iteration, after that only
+// the expansions inside the already compiled body are redone
+void run_for(Program* prog,Node node,Runner* r) {
+	Part name=prog->parts.items[prog->words.items[node.word].part];
+	size_t base=r->loops.len;
+	size_t count=0;
+	sprintf(retbuf,"%d",WEXITSTATUS(r->status));
+	for(size_t i=0; i<node.len; i++) {
+		StrBuf word={0};
+		if(!expand_word(prog,prog->words.items[node.word+1+i],&word,(StrArr) {0},&r->arena,r)) continue;
+		for(size_t j=0; j<word.len; j++) da_append(&r->loops,word.items[j]);
+		count++;
+	}
+	arena_reset(&r->arena);
+	r->status=0;
+	// by offset, as loops inside the body can move the buffer
+	size_t item=base;
+	for(size_t i=0; i<count && !check_interrupt(r); i++) {
+		set_var(prog->text.items+name.off,name.len,r->loops.items+item,false);
+		run_list(prog,node.right,r);
+		item+=strlen(r->loops.items+item)+1;
+	}
+	r->loops.len=base;
+}
+
+void run_node(Program* prog,size_t index,Runner* r) {
+	Node node=prog->nodes.items[index];
+	switch(node.kind) {
+		case NODE_PIPELINE:
+			run_pipeline(prog,node.pipeline,false,r);
+			break;
+		case NODE_AND:
+		case NODE_OR:
+			run_node(prog,node.left,r);
+			if(!check_interrupt(r) && (r->status==0)==(node.kind==NODE_AND)) run_node(prog,node.right,r);
+			break;
+		case NODE_IF:
+			run_list(prog,node.left,r);
+			if(check_interrupt(r)) break;
+			if(r->status==0) run_list(prog,node.right,r);
+			else if(node.orelse!=NO_NODE) run_list(prog,node.orelse,r);
+			else r->status=0;
+			break;
+		case NODE_WHILE: {
+			int status=0;
+			while(1) {
+				run_list(prog,node.left,r);
+				if(check_interrupt(r) || r->status!=0) break;
+				run_list(prog,node.right,r);
+				status=r->status;
+				if(check_interrupt(r)) break;
+			}
+			if(!check_interrupt(r)) r->status=status;
+			break;
+		}
+		case NODE_FOR:
+			run_for(prog,node,r);
+			break;
+	}
+}
+
+void run_list(Program* prog,size_t node,Runner* r) {
+	for(; node!=NO_NODE && !check_interrupt(r); node=prog->nodes.items[node].next) run_node(prog,node,r);
+}
+
+// Runs the top level commands of prog in order, with last set nothing comes after them
+// so the final command can take over the shell process
+void run_program(Program* prog,bool last,Runner* r) {
+	r->interrupted=false;
+	sigint_caught=0;
+	for(size_t i=0; i<prog->top.len && !check_interrupt(r); i++) {
+		Node* node=&prog->nodes.items[prog->top.items[i]];
+		if(last && i+1==prog->top.len && node->kind==NODE_PIPELINE) run_pipeline(prog,node->pipeline,true,r);
+		else run_node(prog,prog->top.items[i],r);
+	}
+}
+
+// The builtin a substitution consists of when it can run inside the shell
+Builtin* pure_builtin(Program* sub) {
+	if(sub->top.len!=1) return NULL;
+	Node node=sub->nodes.items[sub->top.items[0]];
+	if(node.kind!=NODE_PIPELINE) return NULL;
+	Pipeline pipeline=sub->pipelines.items[node.pipeline];
+	if(pipeline.len!=1 || pipeline.background || pipeline.timed) return NULL;
+	Stage stage=sub->stages.items[pipeline.stage];
+	if(stage.len==0 || stage.nvars || stage.nredirs) return NULL;
+	Word word=sub->words.items[stage.word];
+	Part part=sub->parts.items[word.part];
+	char name[32];
+	if(word.len!=1 || part.kind!=PART_LIT || part.len>=sizeof(name)) return NULL;
+	memcpy(name,sub->text.items+part.off,part.len);
+	name[part.len]='\0';
+	Builtin* builtin=find_builtin(name);
+	return builtin && builtin->pure?builtin:NULL;
+}
+
+// Appends bytes to an arena backed buffer, growing it at least a block at a time
+void arena_append(Arena* arena,StrBuf* buf,char* data,size_t len) {
+	if(buf->len+len>buf->cap) {
+		size_t cap=buf->cap*2>buf->len+len?buf->cap*2:buf->len+len+INPUT_READ_BLOCK;
+		buf->items=arena_grow(arena,buf->items,buf->len,cap);
+		buf->cap=cap;
+	}
+	memcpy(buf->items+buf->len,data,len);
+	buf->len+=len;
+}
+
+// Runs the commands of a substitution and appends what they print to out, without the
+// trailing newlines. A lone pure builtin runs in the shell with stdout going to memory,
+// anything else in a forked copy of the shell whose output comes through a pipe
+void command_output(Program* sub,Runner* parent,StrBuf* out,Arena* arena) {
+	static StrArr nohistory={0};
+	static char nocwd[PATH_MAX]="";
+	// nested substitutions each get a runner of their own that stays warm between uses
+	static Runner runners[SUBST_MAX_DEPTH];
+	static size_t depth=0;
+	if(depth>=SUBST_MAX_DEPTH) {
+		fprintf(stderr,"%s: command substitutions nested too deeply\n",pname);
+		return;
+	}
+	Runner* r=&runners[depth++];
+	r->history=parent?parent->history:&nohistory;
+	r->cwd=parent?parent->cwd:&nocwd;
+	r->status=parent?parent->status:0;
+	r->interrupted=false;
+	size_t start=out->len;
+	Builtin* builtin=pure_builtin(sub);
+	if(builtin) {
+		expand_pipeline(sub,sub->pipelines.items[0],&r->cmds,&r->arena,r);
+		char* buf=NULL;
+		size_t size=0;
+		FILE* mem=open_memstream(&buf,&size);
+		if(mem) {
+			fflush(stdout);
+			FILE* saved=stdout;
+			stdout=mem;
+			builtin->fn(&r->cmds.items[0],r->history,r->status);
+			stdout=saved;
+			fclose(mem);
+			arena_append(arena,out,buf,size);
+			free(buf);
+		}
+		arena_reset(&r->arena);
+	} else {
+		int fds[2];
+		// only an interactive shell makes the substitution a job of its own, so C-c stops
+		// the substitution and not the shell. A script keeps it in its own group
+		bool job=interactive;
+		bool tty=tcgetpgrp(STDIN_FILENO)==getpgid(getpid());
+		fflush(stdout);
+		pid_t pid=pipe(fds)<0?-1:fork();
+		if(pid==0) {
+			close(fds[0]);
+			dup2(fds[1],STDOUT_FILENO);
+			close(fds[1]);
+			if(job) {
+				setpgid(0,0);
+				signal(SIGINT,SIG_DFL);
+				signal(SIGQUIT,SIG_DFL);
+				signal(SIGTSTP,SIG_DFL);
+			}
+			interactive=false;
+			run_program(sub,true,r);
+			fflush(stdout);
+			_exit(WEXITSTATUS(r->status));
+		}
+		if(pid<0) {
+			fprintf(stderr,"%s: command substitution: %s\n",pname,strerror(errno));
+		} else {
+			close(fds[1]);
+			if(job) setpgid(pid,pid);
+			if(job && tty) tcsetpgrp(STDIN_FILENO,pid);
+			char block[INPUT_READ_BLOCK];
+			ssize_t count;
+			while((count=read(fds[0],block,sizeof(block)))!=0) {
+				if(count<0 && errno==EINTR) continue;
+				if(count<0) break;
+				arena_append(arena,out,block,count);
 			}
+			close(fds[0]);
+			while(waitpid(pid,NULL,0)<0 && errno==EINTR);
+			// whatever the substitution did with the terminal, the shell had it before
+			if(tty) tcsetpgrp(STDIN_FILENO,getpgid(getpid()));
 		}
 	}
+	while(out->len>start && out->items[out->len-1]=='\n') out->len--;
+	depth--;
 }
 
 int main(int argc,char** argv) {
 	signal(SIGWINCH,getsize);
-	signal(SIGTTOU,SIG_IGN);
+	ignore_signal(SIGTTOU,NULL);
 	pname=argv[0];
-	char* homedir=getenv("HOME");
-	char* pathenv=getenv("PATH");
-	if(homedir==NULL) {
+	char* homedir=get_var("HOME");
+	char* pathenv=get_var("PATH");
+	if(homedir) {
+		homedir=strdup(homedir);
+	} else {
 		homedir=malloc(PATH_MAX);
 		sprintf(homedir,"/home/%s",getpwuid(getuid())->pw_name);
 	}
 	if(pathenv==NULL) {
 		pathenv="/usr/local/sbin:/usr/local/bin:/usr/bin";
-		setenv("PATH",pathenv,1);
+		set_var("PATH",4,pathenv,true);
 	}
 	remove_dir(pname,pname);
 	if(strlen(pname)==0 || argc<1) {
 		pname="(abysh)";
 		fprintf(stderr,"%s: warning: weird environment\n",pname);
 	}
-	char* shlvlenv=getenv("SHLVL");
+	char* shlvlenv=get_var("SHLVL");
 	if(shlvlenv==NULL) shlvlenv="";
 	int shlvl=atoi(shlvlenv);
 	if(shlvl<0) shlvl=0;
@@ -813,50 +5202,111 @@ int main(int argc,char** argv) {
 	shlvl++;
 	char shlvlbuf[10];
 	sprintf(shlvlbuf,"%d",shlvl);
-	setenv("SHLVL",shlvlbuf,1);
+	set_var("SHLVL",5,shlvlbuf,true);
 	StrArr history={0};
 	StrBuf command={0};
-	StrBuf parsedcmd={0};
-	char cwd[PATH_MAX];
-	char promptpath[PATH_MAX];
-	char prompt[PATH_MAX*2];
-	Cmds cmds={0};
-	int status=0;
+	char cwd[PATH_MAX]="";
+	Runner runner={.history=&history,.cwd=&cwd};
+	interactive=argc<=1 && isatty(STDIN_FILENO);
+	events_init(interactive);
+	if(interactive) {
+		// C-c and C-z are for the jobs, the shell leads a process group of its own
+		// that owns the terminal whenever no job does
+		ignore_signal(SIGQUIT,NULL);
+		ignore_signal(SIGTSTP,NULL);
+		catch_sigint();
+		setpgid(0,0);
+		tcsetpgrp(STDIN_FILENO,getpid());
+	}
 	if(argc>1) {
-		FILE* script=fopen(argv[1],"rb");
-		if(script==NULL) {
-			fprintf(stderr,"%s: %s: %s\n",pname,argv[1],strerror(errno));
-			return 1;
-		}
-		ssize_t count=0;
-		char* curcmd=NULL;
-		for(size_t n=0; (count=getline(&curcmd,&n,script))!=-1;) {
-			char* endl=strchr(curcmd,'\n');
-			if(endl) *endl='\0';
-			if(!parse_args(&cmds,curcmd,&parsedcmd)) continue;
-			run_command(&cmds,&history,&cwd,&status,homedir);
-		}
-		if(curcmd) free(curcmd);
-		fclose(script);
-		return WEXITSTATUS(status);
+		Program script={0};
+		if(strcmp(argv[1],"-c")==0) {
+			if(argc<3) {
+				fprintf(stderr,"%s: -c: option requires an argument\n",pname);
+				return 2;
+			}
+			if(!compile_text(&script,argv[2],strlen(argv[2]),1,NULL,NULL)) return 2;
+		} else if(!load_script(&script,argv[1])) {
+			return 2;
+		}
+		run_program(&script,true,&runner);
+		return WEXITSTATUS(runner.status);
+	}
+	Program prog={0};
+	StrBuf pending={0};
+	bool incomplete;
+	if(!interactive) {
+		// commands are piped in, each runs as soon as its last line arrives so a producer
+		// can drive the shell, and there is no prompt, history or terminal to deal with
+		StrBuf input={0};
+		size_t pos=0;
+		bool eof=false;
+		char* item;
+		size_t first=1;
+		script_on_stdin=fstat(STDIN_FILENO,&script_stdin)==0;
+		size_t retry=0;
+		while((item=read_item(&input,&pos,&eof))) {
+			for(char* ch=item; *ch; ch++) da_append(&pending,*ch);
+			da_append(&pending,'\n');
+			// a command spanning many lines is compiled again only once it doubled in size
+			// or no more lines are waiting, not once for every line
+			bool waiting=memchr(input.items+pos,'\n',input.len-pos) || (eof && pos<input.len);
+			if(pending.len<retry && waiting) continue;
+			retry=0;
+			// every complete command runs, the rest waits for more lines unless it has a
+			// syntax error, then everything up to the end of that line is dropped
+			while(pending.len) {
+				program_reset(&prog);
+				size_t done;
+				bool ok=compile_text(&prog,pending.items,pending.len,first,&incomplete,&done);
+				run_program(&prog,false,&runner);
+				if(!ok && !incomplete) runner.status=2<<8;
+				for(size_t i=0; i<done; i++) first+=pending.items[i]=='\n';
+				memmove(pending.items,pending.items+done,pending.len-done);
+				pending.len-=done;
+				if(incomplete) {
+					retry=pending.len*2;
+					break;
+				}
+			}
+		}
+		if(pending.len) {
+			program_reset(&prog);
+			bool ok=compile_text(&prog,pending.items,pending.len,first,NULL,NULL);
+			run_program(&prog,false,&runner);
+			if(!ok) runner.status=2<<8;
+		}
+		return WEXITSTATUS(runner.status);
 	}
 	populate_history(&history,homedir);
 	while(1) {
-		getcwd(cwd,PATH_MAX);
-		setenv("PWD",cwd,1);
-		if(strcmp(homedir,cwd)==0) sprintf(promptpath,"~");
-		else remove_dir(promptpath,cwd);
-		if(promptpath[0]=='\0') strcpy(promptpath,cwd);
-		snprintf(prompt,sizeof(prompt),"%s %s > ",pname,promptpath);
-		sprintf(retbuf,"%d",WEXITSTATUS(status));
-		if(WEXITSTATUS(status)>0) {
-			sprintf(prompt+strlen(pname)+strlen(promptpath)+2,"[%s] > ",retbuf);
-		}
-		readline(prompt,&command,history);
+		if(pending.len==0) {
+			getcwd(cwd,PATH_MAX);
+			set_var("PWD",3,cwd,true);
+			if(strcmp(homedir,cwd)==0) sprintf(main_prompt.path,"~");
+			else remove_dir(main_prompt.path,cwd);
+			if(main_prompt.path[0]=='\0') strcpy(main_prompt.path,cwd);
+			sprintf(retbuf,"%d",WEXITSTATUS(runner.status));
+			main_prompt.status=WEXITSTATUS(runner.status);
+			git_prompt_refresh(cwd);
+			prompt_build();
+			reap_jobs();
+			report_jobs(false);
+		}
+		// the lines of an unfinished if, loop or string get a short prompt of their own
+		if(!readline(pending.len?"> ":main_prompt.text,&command,history)) {
+			pending.len=0;
+			continue;
+		}
 		char* trimmed=command.items;
-		trim(&trimmed);
+		size_t len=trim(&trimmed);
 		add_history(trimmed,&history);
-		if(!parse_args(&cmds,trimmed,&parsedcmd)) continue;
-		run_command(&cmds,&history,&cwd,&status,homedir);
+		for(size_t i=0; i<len; i++) da_append(&pending,trimmed[i]);
+		da_append(&pending,'\n');
+		program_reset(&prog);
+		if(compile_text(&prog,pending.items,pending.len,0,&incomplete,NULL)) run_program(&prog,false,&runner);
+		else if(incomplete) continue;
+		else runner.status=2<<8;
+		pending.len=0;
 	}
 }
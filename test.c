@@ -0,0 +1,152 @@
+// Terminal tests for abysh, build and run them with `./build.sh test`
+// Every test drives the freshly built ./abysh through a pseudo terminal, types into it
+// like a user would and checks what the shell printed back
+#include <errno.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define TEST_OUTPUT_CAP (64*1024)
+#define TEST_TIMEOUT_MS 5000
+
+typedef struct {
+	pid_t pid;
+	int fd;
+	char out[TEST_OUTPUT_CAP];
+	size_t len;
+} Term;
+
+char* shell_path="./abysh";
+
+// Starts an interactive shell, or one running script when it is given
+bool term_start(Term* t,char* script) {
+	char home[]="/tmp/abysh-test-XXXXXX";
+	if(mkdtemp(home)==NULL) return false;
+	char path[sizeof(home)+16];
+	snprintf(path,sizeof(path),"%s/script",home);
+	if(script) {
+		FILE* file=fopen(path,"w");
+		if(file==NULL) return false;
+		fputs(script,file);
+		fclose(file);
+	}
+	struct winsize size={.ws_row=24,.ws_col=80};
+	t->len=0;
+	t->pid=forkpty(&t->fd,NULL,NULL,&size);
+	if(t->pid<0) return false;
+	if(t->pid==0) {
+		setenv("HOME",home,1);
+		if(script) execl(shell_path,shell_path,path,(char*)NULL);
+		else execl(shell_path,shell_path,(char*)NULL);
+		_exit(127);
+	}
+	return true;
+}
+
+void term_type(Term* t,char* keys) {
+	write(t->fd,keys,strlen(keys));
+}
+
+// Reads what the shell prints until text shows up, false when it did not in time
+bool term_expect(Term* t,char* text) {
+	for(int waited=0; waited<TEST_TIMEOUT_MS;) {
+		t->out[t->len]='\0';
+		if(strstr(t->out,text)) return true;
+		struct pollfd pfd={.fd=t->fd,.events=POLLIN};
+		if(poll(&pfd,1,100)<=0) {
+			waited+=100;
+			continue;
+		}
+		ssize_t count=read(t->fd,t->out+t->len,TEST_OUTPUT_CAP-1-t->len);
+		if(count<=0) return false;
+		t->len+=count;
+	}
+	return false;
+}
+
+// Waits for the shell to exit, false when it did not in time
+bool term_exits(Term* t) {
+	for(int waited=0; waited<TEST_TIMEOUT_MS; waited+=100) {
+		if(waitpid(t->pid,NULL,WNOHANG)==t->pid) {
+			t->pid=0;
+			return true;
+		}
+		usleep(100*1000);
+	}
+	return false;
+}
+
+void term_stop(Term* t) {
+	if(t->pid>0) {
+		kill(t->pid,SIGKILL);
+		waitpid(t->pid,NULL,0);
+	}
+	close(t->fd);
+}
+
+// The first stage reads the terminal, it has to own it from the start or it is stopped
+bool test_pipeline_reads_tty(Term* t) {
+	term_type(t,"cat | sort\r");
+	usleep(300*1000);
+	term_type(t,"b\ra\r\x04");
+	if(!term_expect(t,"a\r\nb\r\n")) return false;
+	term_type(t,"echo status=$?\r");
+	return term_expect(t,"status=0") && strstr(t->out,"Stopped")==NULL;
+}
+
+// parallel ignores C-c while its jobs run, afterwards C-c has to end a wait again
+bool test_interrupt_after_parallel(Term* t) {
+	term_type(t,"parallel -j 1 echo ::: one two\r");
+	if(!term_expect(t,"one\r\ntwo\r\n")) return false;
+	term_type(t,"sleep 5 &\r");
+	term_type(t,"wait\r");
+	usleep(300*1000);
+	term_type(t,"\x03");
+	term_type(t,"echo status=$?\r");
+	return term_expect(t,"status=130");
+}
+
+// A script's substitution must leave the terminal to the script, or C-c cannot end it
+bool test_script_keeps_tty(Term* t) {
+	if(!term_expect(t,"looping")) return false;
+	term_type(t,"\x03");
+	return term_exits(t);
+}
+
+typedef struct {
+	char* name;
+	bool (*fn)(Term* t);
+	char* script;
+} Test;
+
+Test tests[]={
+	{"pipeline_reads_tty",test_pipeline_reads_tty,NULL},
+	{"interrupt_after_parallel",test_interrupt_after_parallel,NULL},
+	{"script_keeps_tty",test_script_keeps_tty,"x=$(ls; true)\necho looping\nwhile true; do true; done\n"},
+};
+
+int main(int argc,char** argv) {
+	if(argc>1) shell_path=argv[1];
+	int failed=0;
+	for(size_t i=0; i<sizeof(tests)/sizeof(tests[0]); i++) {
+		static Term term;
+		if(!term_start(&term,tests[i].script)) {
+			fprintf(stderr,"%s: cannot start %s: %s\n",tests[i].name,shell_path,strerror(errno));
+			return 1;
+		}
+		bool ok=(tests[i].script || term_expect(&term,"> ")) && tests[i].fn(&term);
+		term_stop(&term);
+		printf("%s %s\n",ok?"ok  ":"FAIL",tests[i].name);
+		if(!ok) {
+			printf("%s\n",term.out);
+			failed++;
+		}
+	}
+	return failed?1:0;
+}